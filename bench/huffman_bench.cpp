@@ -0,0 +1,431 @@
+#define MY_TESTS
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+#include "huffman.h"
+#include "../test/test_data.h"
+
+namespace {
+    // BitReader as it was before the refill-based rewrite: one stream read per byte, one branch per bit
+    class LegacyBitReader {
+    public:
+        explicit LegacyBitReader(std::ifstream& in) : in(in) {}
+
+        LegacyBitReader& operator>>(bool& b) {
+            if (byte_index == 0) in.read((char*) &byte, sizeof(byte));
+            b = byte & (1 << (Huffman::byte_size - 1 - byte_index++));
+            if (byte_index == Huffman::byte_size) byte_index = 0;
+            return *this;
+        }
+
+        operator bool() const {
+            return in.operator bool();
+        }
+
+    private:
+        unsigned char byte = 0;
+        int byte_index = 0;
+        std::ifstream& in;
+    };
+
+    std::string bench_file = "bench_input.bin";
+    const long long bench_bytes = 1 << 24;
+
+    void writeRandomFile(const std::string& name, long long size) {
+        std::mt19937_64 rng(42);
+        std::ofstream out(name);
+        std::vector<char> data(size);
+        for (auto& c: data) c = (char) rng();
+        out.write(data.data(), size);
+    }
+
+    void report(const std::string& name, long long bytes, const std::function<unsigned long long()>& run) {
+        auto start = std::chrono::steady_clock::now();
+        unsigned long long checksum = run();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << name << ": " << bytes / elapsed.count() / 1e6 << " MB/s (checksum " << checksum << ")"
+                  << std::endl;
+    }
+
+    void benchBitReaders() {
+        report("legacy BitReader, 1 bit per call", bench_bytes, [] {
+            std::ifstream in(bench_file);
+            LegacyBitReader r(in);
+            unsigned long long sum = 0;
+            bool b;
+            for (long long i = 0; i < bench_bytes * Huffman::byte_size; i++) {
+                r >> b;
+                sum += b;
+            }
+            return sum;
+        });
+        report("BitReader, 1 bit per call", bench_bytes, [] {
+            std::ifstream in(bench_file);
+            Huffman::BitReader r(in);
+            unsigned long long sum = 0;
+            bool b = false;
+            while (r >> b)
+                sum += b;
+            return sum;
+        });
+        for (int n: {1, 11, 32}) {
+            report("BitReader, peek/consume " + std::to_string(n) + " bits", bench_bytes, [n] {
+                std::ifstream in(bench_file);
+                Huffman::BitReader r(in);
+                unsigned long long sum = 0;
+                for (r.refill(); r.available() >= n; r.refill()) {
+                    sum += r.peek(n);
+                    r.consume(n);
+                }
+                return sum;
+            });
+        }
+    }
+
+    void benchHistogram() {
+        std::vector<unsigned char> random(bench_bytes), same(bench_bytes, 'a');
+        std::ifstream in(bench_file);
+        in.read((char*) random.data(), bench_bytes);
+        for (auto data: {&random, &same}) {
+            std::string kind = data == &random ? "random bytes" : "single byte";
+            report("naive histogram, " + kind, bench_bytes, [data] {
+                long long histogram[Huffman::Tree::max_chars] = {};
+                for (unsigned char c: *data)
+                    histogram[c]++;
+                return (unsigned long long) histogram[(*data)[0]];
+            });
+            report("Tree::countBytes, " + kind, bench_bytes, [data] {
+                long long histogram[Huffman::Tree::max_chars] = {};
+                Huffman::Tree::countBytes(data->data(), data->size(), histogram);
+                return (unsigned long long) histogram[(*data)[0]];
+            });
+        }
+        report("Tree::loadRawEntries from file", bench_bytes, [] {
+            std::ifstream in(bench_file);
+            Huffman::Tree t;
+            t.loadRawEntries(in);
+            return (unsigned long long) t.count;
+        });
+    }
+
+    const std::vector<std::string> corpus = {
+            "a-z0-9.txt", "lorem-ipsum.txt", "many-a.txt", "russian.txt", "small.txt", "wiki-frequency-test.txt"
+    };
+
+    std::string resourcePath(const std::string& name) {
+        return "./test/resources/" + name;
+    }
+
+    long long encodedBits(Huffman::Tree& t, int max_code_length) {
+        t.max_code_length = max_code_length;
+        t.lengths_loaded = false;
+        t.buildTree();
+        long long bits = 0;
+        for (int c = 0; c < Huffman::Tree::max_chars; c++)
+            bits += t.entries[c] * t.lengths[c];
+        return bits;
+    }
+
+    void benchLengthLimit() {
+        std::vector<int> limits = {11, 12, 13, 15};
+        std::cout << std::left << std::setw(26) << "file" << std::setw(14) << "unconstrained";
+        for (int limit: limits)
+            std::cout << std::setw(18) << "L=" + std::to_string(limit) + " (loss %)";
+        std::cout << std::endl;
+        auto row = [&limits](const std::string& name, Huffman::Tree& t) {
+            long long unconstrained = encodedBits(t, Huffman::Tree::max_code_length_limit);
+            std::cout << std::setw(26) << name << std::setw(14) << unconstrained;
+            for (int limit: limits) {
+                long long bits = encodedBits(t, limit);
+                double loss = unconstrained ? 100.0 * (bits - unconstrained) / unconstrained : 0;
+                std::cout << std::setw(18) << std::to_string(bits) + " (" + std::to_string(loss).substr(0, 5) + ")";
+            }
+            std::cout << std::endl;
+        };
+        for (auto& name: corpus) {
+            Huffman::Tree t;
+            std::ifstream in(resourcePath(name));
+            t.loadRawEntries(in);
+            row(name, t);
+        }
+        Huffman::Tree t;
+        std::vector<long long> fibonacci = fibonacci_frequencies(30);
+        std::copy(fibonacci.begin(), fibonacci.end(), t.entries);
+        row("fibonacci, 30 symbols", t);
+    }
+
+    // Time per table of the code lengths from a histogram: by merging a tree as legacy archives need, and in place from the sorted frequencies
+    void benchCodeLengths() {
+        std::ifstream in(resourcePath("lorem-ipsum.txt"));
+        Huffman::Tree text;
+        text.loadRawEntries(in);
+        Huffman::Tree flat;
+        std::mt19937_64 rng(42);
+        for (auto& f: flat.entries) f = 1000 + rng() % 1000;
+        const int tables = 20000;
+        for (Huffman::Tree* source: {&text, &flat}) {
+            std::string kind = source == &text ? "lorem-ipsum.txt" : "256 similar frequencies";
+            for (bool merged: {true, false}) {
+                Huffman::Tree t = *source;
+                auto start = std::chrono::steady_clock::now();
+                unsigned long long checksum = 0;
+                for (int i = 0; i < tables; i++) {
+                    if (merged) {
+                        t.clear();
+                        std::copy(source->entries, source->entries + Huffman::Tree::max_chars, t.entries);
+                        for (int c = 0; c < Huffman::Tree::max_chars; c++)
+                            if (t.entries[c] != 0) t.pushLeaf(c, t.entries[c]);
+                        t.mergeTree();
+                        checksum += t.lengths['e'];
+                    } else {
+                        t.computeCodeLengths();
+                        checksum += t.lengths['e'];
+                    }
+                }
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                std::cout << (merged ? "merged tree, " : "in place, ") << kind << ": " << elapsed.count() / tables * 1e6
+                          << " us per table (checksum " << checksum << ")" << std::endl;
+            }
+        }
+    }
+
+    // Text-like input: lorem-ipsum.txt repeated up to bench_bytes
+    std::vector<unsigned char> benchText() {
+        std::ifstream in(resourcePath("lorem-ipsum.txt"));
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::vector<unsigned char> data(bench_bytes);
+        for (long long i = 0; i < bench_bytes; i++)
+            data[i] = text[i % text.size()];
+        return data;
+    }
+
+    void benchInterleaved() {
+        std::vector<unsigned char> text = benchText();
+        for (int streams: {1, 2, 4, 8}) {
+            Huffman::Tree t;
+            t.countEntries(text.data(), text.size());
+            t.buildTree();
+            t.buildDecodeTable();
+            t.stream_count = streams;
+            std::vector<char> coded;
+            {
+                Huffman::BitWriter writer(coded);
+                if (streams == 1)
+                    t.encodeSymbols(text.data(), text.size(), writer);
+                else
+                    t.encodeInterleaved(text.data(), text.size(), writer);
+                writer.flush();
+            }
+            std::vector<unsigned char> decoded(text.size());
+            report("decode, " + std::to_string(streams) + " stream(s)", bench_bytes, [&] {
+                Huffman::BitReader reader(coded.data(), coded.size());
+                if (streams == 1)
+                    t.decodeSymbols(reader, decoded.data(), decoded.size());
+                else
+                    t.decodeInterleaved(reader, decoded.data(), decoded.size());
+                return (unsigned long long) (decoded == text);
+            });
+        }
+    }
+
+    // Encoding speed with one lookup per byte and with the pair table, on inputs of different average
+    // code lengths, and the time to build the pair table
+    void benchPairs() {
+        std::vector<unsigned char> text = benchText(), random(bench_bytes), skewed(bench_bytes);
+        std::ifstream in(bench_file);
+        in.read((char*) random.data(), bench_bytes);
+        std::mt19937_64 rng(42);
+        for (auto& c: skewed) c = rng() % 16 == 0 ? 'a' + rng() % 26 : 'a';
+        for (auto data: {&skewed, &text, &random}) {
+            Huffman::Tree t;
+            t.countEntries(data->data(), data->size());
+            t.buildTree();
+            long long bits = 0;
+            for (int c = 0; c < Huffman::Tree::max_chars; c++)
+                bits += t.entries[c] * t.lengths[c];
+            std::string kind = std::to_string((double) bits / t.count).substr(0, 4) + " bits per byte";
+            for (bool pairs: {false, true}) {
+                t.pair_coding = pairs;
+                if (pairs) t.buildPairTable();
+                std::vector<char> coded;
+                coded.reserve(data->size());
+                report(std::string(pairs ? "pair table" : "single table") + ", " + kind, bench_bytes, [&] {
+                    coded.clear();
+                    Huffman::BitWriter writer(coded);
+                    unsigned long long total_bits = t.encodeSymbols(data->data(), data->size(), writer);
+                    writer.flush();
+                    return total_bits;
+                });
+            }
+        }
+        Huffman::Tree t;
+        t.countEntries(text.data(), text.size());
+        t.buildTree();
+        const int tables = 200;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < tables; i++)
+            t.buildPairTable();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "pair table build: " << elapsed.count() / tables * 1e6 << " us" << std::endl;
+    }
+
+    // Decoding speed with one symbol per lookup and with the multi-symbol table, on inputs of
+    // different average code lengths
+    void benchMultiSymbol() {
+        std::vector<unsigned char> text = benchText(), few(bench_bytes), skewed(bench_bytes), random(bench_bytes);
+        std::mt19937_64 rng(42);
+        for (auto& c: few) c = 'a' + rng() % 4;
+        for (auto& c: skewed) c = rng() % 16 == 0 ? 'a' + rng() % 26 : 'a';
+        for (auto& c: random) c = rng() % 64;
+        for (auto data: {&skewed, &few, &text, &random}) {
+            Huffman::Tree t;
+            t.countEntries(data->data(), data->size());
+            t.buildTree();
+            t.buildDecodeTable();
+            t.buildMultiDecodeTable();
+            long long bits = 0;
+            for (int c = 0; c < Huffman::Tree::max_chars; c++)
+                bits += t.entries[c] * t.lengths[c];
+            std::string kind = std::to_string((double) bits / t.count).substr(0, 4) + " bits per byte";
+            std::vector<char> coded;
+            {
+                Huffman::BitWriter writer(coded);
+                t.encodeSymbols(data->data(), data->size(), writer);
+                writer.flush();
+            }
+            std::vector<unsigned char> decoded(data->size());
+            for (bool multi: {false, true}) {
+                t.multi_decoding = multi;
+                report(std::string(multi ? "multi-symbol table" : "single-symbol table") + ", " + kind, bench_bytes,
+                       [&] {
+                           Huffman::BitReader reader(coded.data(), coded.size());
+                           t.decodeSymbols(reader, decoded.data(), decoded.size());
+                           return (unsigned long long) (decoded == *data);
+                       });
+            }
+        }
+    }
+
+    // Archive sizes of the static and the adaptive coder, then the adaptive coder's speed
+    void benchAdaptive() {
+        std::cout << std::left << std::setw(26) << "file" << std::setw(12) << "input" << std::setw(12) << "static"
+                  << std::setw(12) << "adaptive" << std::endl;
+        for (auto& name: corpus) {
+            std::ifstream in(resourcePath(name));
+            std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            std::vector<char> coded, adaptive_coded;
+            Huffman::Tree t;
+            t.encodeBuffer(data.data(), data.size(), coded);
+            t.adaptive = true;
+            t.encodeBuffer(data.data(), data.size(), adaptive_coded);
+            std::cout << std::setw(26) << name << std::setw(12) << data.size() << std::setw(12) << coded.size()
+                      << std::setw(12) << adaptive_coded.size() << std::endl;
+        }
+        std::vector<unsigned char> text = benchText();
+        std::vector<char> coded, decoded;
+        Huffman::Tree t;
+        t.adaptive = true;
+        report("adaptive encode", bench_bytes, [&] {
+            t.encodeBuffer((const char*) text.data(), text.size(), coded);
+            return (unsigned long long) coded.size();
+        });
+        report("adaptive decode", bench_bytes, [&] {
+            t.decodeBuffer(coded.data(), coded.size(), decoded);
+            return (unsigned long long) std::equal(decoded.begin(), decoded.end(), text.begin());
+        });
+    }
+
+    // Archive sizes with a single table and with order-1 context tables, then decoding speed of both
+    void benchContext() {
+        std::cout << std::left << std::setw(26) << "file" << std::setw(12) << "input" << std::setw(12) << "single"
+                  << std::setw(12) << "order-1" << std::endl;
+        for (auto& name: corpus) {
+            std::ifstream in(resourcePath(name));
+            std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            std::vector<char> coded, context_coded;
+            Huffman::Tree t;
+            t.encodeBuffer(data.data(), data.size(), coded);
+            t.context = true;
+            t.encodeBuffer(data.data(), data.size(), context_coded);
+            std::cout << std::setw(26) << name << std::setw(12) << data.size() << std::setw(12) << coded.size()
+                      << std::setw(12) << context_coded.size() << std::endl;
+        }
+        std::vector<unsigned char> text = benchText();
+        for (bool context: {false, true}) {
+            std::vector<char> coded, decoded;
+            Huffman::Tree t;
+            t.context = context;
+            t.encodeBuffer((const char*) text.data(), text.size(), coded);
+            report(std::string(context ? "order-1" : "single table") + " decode, " + std::to_string(coded.size())
+                   + " bytes", bench_bytes, [&] {
+                t.decodeBuffer(coded.data(), coded.size(), decoded);
+                return (unsigned long long) std::equal(decoded.begin(), decoded.end(), text.begin());
+            });
+        }
+    }
+
+    // Small payloads from the second half of lorem-ipsum.txt, each coded with its own table and with a
+    // table trained on the first half
+    void benchTrained() {
+        std::ifstream in(resourcePath("lorem-ipsum.txt"));
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::string sample_file = "bench_sample.txt", table_file = "bench_table.tbl";
+        std::ofstream(sample_file) << text.substr(0, text.size() / 2);
+        Huffman::Tree trainer;
+        trainer.trainTable({sample_file}, table_file);
+        for (size_t payload: {64, 512, 4096}) {
+            std::vector<std::string> payloads;
+            for (size_t i = text.size() / 2; i + payload <= text.size(); i += payload)
+                payloads.push_back(text.substr(i, payload));
+            long long bytes = payloads.size() * payload;
+            for (bool trained: {false, true}) {
+                Huffman::Tree t;
+                if (trained) t.table_file = table_file;
+                std::vector<char> coded;
+                report(std::string(trained ? "trained table" : "own table") + ", " + std::to_string(payload)
+                       + " byte payloads", bytes, [&] {
+                    unsigned long long archive_bytes = 0;
+                    for (auto& p: payloads)
+                        archive_bytes += t.encodeBuffer(p.data(), p.size(), coded);
+                    return archive_bytes;
+                });
+            }
+        }
+        remove(sample_file.c_str());
+        remove(table_file.c_str());
+    }
+}
+
+int main(int argc, char* argv[]) {
+    writeRandomFile(bench_file, bench_bytes);
+    std::string only = argc > 1 ? argv[1] : "";
+    if (only.empty() || only == "reader")
+        benchBitReaders();
+    if (only.empty() || only == "histogram")
+        benchHistogram();
+    if (only.empty() || only == "limit")
+        benchLengthLimit();
+    if (only.empty() || only == "lengths")
+        benchCodeLengths();
+    if (only.empty() || only == "interleaved")
+        benchInterleaved();
+    if (only.empty() || only == "pairs")
+        benchPairs();
+    if (only.empty() || only == "multi")
+        benchMultiSymbol();
+    if (only.empty() || only == "adaptive")
+        benchAdaptive();
+    if (only.empty() || only == "context")
+        benchContext();
+    if (only.empty() || only == "trained")
+        benchTrained();
+    remove(bench_file.c_str());
+}
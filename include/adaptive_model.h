@@ -0,0 +1,43 @@
+#pragma once
+
+#include "huffman.h"
+
+namespace Huffman {
+
+    // Code tree of the adaptive (FGK) coder, updated after every symbol the same way on both sides.
+    // Nodes are kept in the order of their FGK numbers, highest first: the root is node 0, weights
+    // never increase along the array and the NYT leaf standing for all symbols not seen yet is last.
+    // A symbol seen for the first time is sent as the NYT code, a 0 bit and its 8 bits, the end of
+    // the data as the NYT code and a 1 bit.
+    class AdaptiveModel {
+    public:
+        AdaptiveModel();
+        void reset();
+
+        // Both return the number of bits written
+        int encode(unsigned char symbol, BitWriter& writer);
+        int encodeEnd(BitWriter& writer);
+        // Decodes the next symbol into symbol, false at the end of the data
+        bool decode(BitReader& reader, unsigned char& symbol, long long& total_bits);
+
+        // Leaves for every byte value and NYT
+        static const int max_nodes = 2 * (Tree::max_chars + 1) - 1;
+
+    private:
+        struct AdaptiveNode {
+            long long weight = 0;
+            short parent = no_node;
+            short left_child = no_node;
+            short right_child = no_node;
+            unsigned char symbol = 0;
+        };
+        int writePath(short v, BitWriter& writer);
+        short addSymbol(unsigned char symbol);
+        void update(short v);
+        void swapNodes(short a, short b);
+        AdaptiveNode nodes[max_nodes];
+        short leaves[Tree::max_chars];
+        short node_count = 0;
+        short nyt = 0;
+    };
+}
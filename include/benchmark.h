@@ -0,0 +1,39 @@
+#pragma once
+
+#include <ostream>
+#include "huffman.h"
+
+namespace Huffman {
+
+    // Speed of one phase over all iterations, in MB (10^6 bytes) of uncompressed data per second
+    struct PhaseSpeed {
+        double mean = 0;
+        double deviation = 0; // standard deviation of the iterations
+        double best = 0;
+    };
+
+    struct BenchmarkResult {
+        long long input_bytes = 0;
+        long long archive_bytes = 0;
+        int iterations = 0;
+        PhaseSpeed compress;
+        PhaseSpeed decompress;
+    };
+
+    // Compresses and decompresses a file held in memory with the buffer API, so that only the coders
+    // are timed. The file is read once and reused for every run.
+    class Benchmark {
+    public:
+        explicit Benchmark(const std::string& file_name);
+
+        // Runs both phases iterations times with the settings of tree and checks every round trip
+        BenchmarkResult run(Tree& tree, int iterations);
+        // One line: the settings, ratio, iterations and the speed of both phases
+        static void print(std::ostream& out, const Tree& tree, const BenchmarkResult& result);
+
+    private:
+        std::vector<char> data;
+        std::vector<char> archive;
+        std::vector<char> decoded;
+    };
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include "huffman.h"
+
+namespace Huffman {
+
+    // Order-1 model: the code of a byte depends on the byte before it (0 before the first one).
+    // The 256 contexts are clustered into at most max_tables groups of similar statistics and every
+    // group has its own canonical table, so decoding stays a table lookup with the table picked by
+    // the previous byte. The header is the number of tables, the group of every context in 4 bits
+    // and the tables as Tree writes them.
+    // A model can code one input after another, its storage then only grows for a larger one.
+    class ContextModel {
+    public:
+        ContextModel();
+
+        // Forget the statistics, the next input is counted from scratch
+        void reset();
+        // Adds the bytes to the statistics of their contexts, continuing after the previous call
+        void count(const unsigned char* data, size_t size);
+        // Clusters the counted contexts and builds the code tables of the groups
+        void build(int max_code_length);
+        // Both return the header bytes
+        long long writeHeader(BitWriter& writer);
+        long long readHeader(BitReader& reader, long long count);
+        // Forget the previous byte, coding starts over at the first one
+        void restart();
+        // Both continue after the previous call and return the coded bits
+        long long encode(const unsigned char* data, size_t size, BitWriter& writer);
+        long long decode(BitReader& reader, unsigned char* out, long long size);
+
+        // Fits the group number in half a byte and keeps the header within a few KB
+        static const int max_tables = 16;
+        static const int map_bytes = Tree::max_chars / 2;
+        // Largest header writeHeader produces
+        static constexpr long long max_header_bytes =
+                1 + map_bytes + max_tables * (sizeof(long long) + sizeof(unsigned short) + 2 * Tree::max_chars);
+
+    private:
+#ifdef MY_TESTS
+        public:
+#endif
+        void cluster();
+        void useTables(size_t table_count);
+        std::vector<std::array<long long, Tree::max_chars>> histograms;
+        unsigned char context_map[Tree::max_chars];
+        std::vector<Tree> tables;
+        unsigned char previous = 0;
+        // Working storage of cluster()
+        std::vector<int> groups;
+        std::vector<std::array<long long, Tree::max_chars>> merged;
+        std::vector<int> owner;
+        std::vector<double> bits;
+        std::vector<double> delta;
+        std::vector<bool> alive;
+        std::vector<int> table_of;
+    };
+}
@@ -1,79 +1,141 @@
 #pragma once
 
-#include "queue"
 #include "string"
 #include "vector"
 #include "fstream"
 #include "list"
+#include "climits"
+#include "array"
+#include "stdexcept"
+#include "mapped_file.h"
+#include "statistics.h"
 
 namespace Huffman {
     const int byte_size = 8;
 
-    class Node {
-    public:
-        Node(std::vector<unsigned char> chars, long long frequency, Node* left_child = nullptr, Node* right_child = nullptr);
-        ~Node();
-        std::vector<unsigned char> chars;
-        long long frequency;
-        Node* left_child = nullptr;
-        Node* right_child = nullptr;
+    const short no_node = -1;
+
+    // Node of a code tree stored in Tree::tree, children are indices into the same array
+    struct Node {
+        long long frequency = 0;
+        short left_child = no_node;
+        short right_child = no_node;
+        unsigned char symbol = 0;
     };
 
-    struct NodePtrComp
+    struct NodeComp
     {
-        bool operator()(const Node* first, const Node* second) const {
-            return first->frequency > second->frequency;
+        const Node* tree;
+        bool operator()(short first, short second) const {
+            return tree[first].frequency > tree[second].frequency;
         }
     };
 
+    // Bits are collected in a 64-bit accumulator and moved to an internal buffer in whole bytes,
+    // the buffer reaches the stream only in large chunks and on flush()
     class BitWriter {
     public:
-        explicit BitWriter(std::ofstream& out);
+        explicit BitWriter(std::ostream& out);
+        // Buffers in the caller's vector, which keeps its capacity for the next writer
+        BitWriter(std::ostream& out, std::vector<char>& buffer);
+        // Collects all output in sink instead of writing it to a stream
+        explicit BitWriter(std::vector<char>& sink);
+        BitWriter(const BitWriter&) = delete;
+        BitWriter& operator=(const BitWriter&) = delete;
+
+        // Appends the lowest length bits of code, most significant first. length must not exceed max_code_bits
+        void write(unsigned long long code, int length) {
+            if (acc_bits + length > 64) spill();
+            acc = (acc << length) | code;
+            acc_bits += length;
+        }
+        // Pads the last byte with zero bits and appends size raw bytes
+        void writeBytes(const char* data, size_t size);
+        // Pads the last byte with zero bits and writes everything buffered so far
         void flush();
 
+        static const int max_code_bits = 56;
+        static const int buffer_size = 1 << 16;
+
         template<class T>
         friend BitWriter& operator<<(BitWriter& w, T& var) {
-            w.flush();
-            w.out.write((char*) &var, sizeof(var));
+            w.writeBytes((char*) &var, sizeof(var));
             return w;
         }
 
         friend BitWriter& operator<<(BitWriter& w, bool& b) {
-            if (!b)
-                w.byte &= ~(1 << (byte_size - 1 - w.byte_index));
-            else
-                w.byte |= (1 << (byte_size - 1 - w.byte_index));
-            w.byte_index++;
-            if (w.byte_index == byte_size) {
-                w.out.write((char*) &w.byte, sizeof(char));
-                w.byte_index = 0;
-                w.byte = 0;
-            }
+            w.write(b, 1);
             return w;
         }
 
     private:
-        unsigned char byte = 0;
-        int byte_index = 0;
-        std::ofstream& out;
+        void spill();
+        void align();
+        void writeBuffer();
+        unsigned long long acc = 0;
+        int acc_bits = 0;
+        std::vector<char> own_buffer;
+        std::vector<char>* buffer;
+        std::ostream* out;
     };
 
+    // Bits are kept MSB-first in the upper bit_count bits of a 64-bit container that is refilled
+    // from a buffered block of the stream or from memory. Past the end of input peek() sees zero bits.
+    // Byte values read with operator>> come from the container first, so a reader that never
+    // touched single bits does not read ahead of what it returned.
     class BitReader {
     public:
-        explicit BitReader(std::ifstream& in);
+        explicit BitReader(std::istream& in);
+        // Reads blocks into the caller's vector, which keeps its capacity for the next reader
+        BitReader(std::istream& in, std::vector<char>& buffer);
+        // Reads size bytes starting at data, which must outlive the reader
+        BitReader(const char* data, size_t size);
+
+        // Tops the container up to at least max_peek_bits bits while input lasts
+        void refill() {
+            // with 8 bytes at hand a full container just takes no new bytes, which saves a branch
+            if (block_end - block_pos >= 8) {
+                int bytes = (63 - bit_count) / byte_size;
+                bits |= loadBigEndian(data + block_pos) >> bit_count;
+                bit_count += bytes * byte_size;
+                bits &= ~0ULL << (64 - bit_count);
+                block_pos += bytes;
+            } else if (bit_count <= max_peek_bits) {
+                refillTail();
+            }
+        }
+        // Next n bits without consuming them, 0 < n <= max_peek_bits
+        unsigned long long peek(int n) const {
+            return bits >> (64 - n);
+        }
+        // Drops n bits, n must not exceed available()
+        void consume(int n) {
+            bits <<= n;
+            bit_count -= n;
+        }
+        int available() const {
+            return bit_count;
+        }
+        // Skips to the next byte boundary and reads size raw bytes
+        BitReader& readBytes(char* out, std::streamsize size);
+
+        static const int max_peek_bits = 56;
+        static const int buffer_size = 1 << 16;
 
         template<class T>
         friend BitReader& operator>>(BitReader& r, T& var) {
-            r.in.read((char*) &var, sizeof(var));
+            r.readBytes((char*) &var, sizeof(var));
             return r;
         }
 
         friend BitReader& operator>>(BitReader& r, bool& b) {
-            if (r.byte_index == 0) r >> r.byte;
-            b = r.byte & (1 << (byte_size - 1 - r.byte_index++));
-            if (r.byte_index == byte_size) {
-                r.byte_index = 0;
+            if (r.bit_count == 0) r.refill();
+            if (r.bit_count == 0) {
+                r.failed = true;
+                return r;
             }
+            b = r.bits >> 63;
+            r.consume(1);
             return r;
         }
 
@@ -81,49 +143,325 @@ namespace Huffman {
 
 
     private:
-        unsigned char byte = 0;
-        int byte_index = 0;
-        std::ifstream& in;
+        // Spelled out so that compilers turn it into a single load and byte swap
+        static unsigned long long loadBigEndian(const char* p) {
+            const unsigned char* b = (const unsigned char*) p;
+            return (unsigned long long) b[0] << 56 | (unsigned long long) b[1] << 48 |
+                   (unsigned long long) b[2] << 40 | (unsigned long long) b[3] << 32 |
+                   (unsigned long long) b[4] << 24 | (unsigned long long) b[5] << 16 |
+                   (unsigned long long) b[6] << 8 | (unsigned long long) b[7];
+        }
+        void refillTail();
+        std::vector<char> block;
+        std::vector<char>* external_block = nullptr;
+        const char* data = nullptr;
+        std::streamsize block_pos = 0;
+        std::streamsize block_end = 0;
+        unsigned long long bits = 0;
+        int bit_count = 0;
+        bool failed = false;
+        std::istream* in;
     };
 
+    // Code of a symbol as the encoder writes it: the lowest length bits of code, most significant first.
+    // Eight bytes, so that the table of all byte values spans 32 cache lines.
+    struct EncodeEntry {
+        unsigned int code = 0;
+        unsigned char length = 0;
+    };
+
+    struct DecodeEntry {
+        unsigned char symbol = 0;
+        unsigned char length = 0; // bits resolved by this entry
+        bool invalid = false;
+        short subtree = no_node; // code is longer than the table, continue walking from here
+    };
+
+    // Several short codes resolved by one lookup of Tree::decode_table_bits bits
+    struct MultiDecodeEntry {
+        unsigned char symbols[4] = {};
+        unsigned char count = 0; // symbols resolved, 0 when the first code needs the single-symbol table
+        unsigned char length = 0; // bits of all of them
+    };
+
+    // Input the coders read in place instead of through a stream: a mapped file or a caller's buffer
+    struct ByteSpan {
+        const char* data = nullptr;
+        size_t size = 0;
+    };
+
+    struct BlockIndexEntry {
+        long long offset = 0; // position of the block frame in the compressed file
+        long long size = 0; // decompressed bytes
+    };
+
+    // One block of a batch that block and stream archives code on several workers: its input and
+    // output bytes where they are copied, where the coder reads and writes them and what it reported
+    struct BlockSlot {
+        std::vector<char> input;
+        std::vector<char> output;
+        const char* data = nullptr;
+        char* block = nullptr;
+        long long size = 0;
+        long long position = 0;
+        long long input_bytes = 0;
+        long long header_bytes = 0;
+    };
+
+    class Encoder;
+    class Decoder;
+    class ContextModel;
 
     class Tree {
     public:
 
         Tree();
-        ~Tree();
         void encodeFile(std::string& input_file_name, std::string& output_file_name, bool print_stat = false, bool clear_on_exit = true);
         void decodeFile(std::string& input_file_name, std::string& output_file_name, bool print_stat = false, bool clear_on_exit = true);
+        // Builds a table that codes every byte value from the statistics of the sample files and
+        // writes it to table_file_name, for use as table_file
+        void trainTable(const std::vector<std::string>& sample_file_names, std::string& table_file_name, bool print_stat = false);
+
+        // Buffer to buffer versions of encodeFile and decodeFile with the same settings and formats.
+        // The vector versions replace the contents of out and reuse its capacity, the others write
+        // at most capacity bytes and throw when that is not enough. They return the bytes written.
+        size_t encodeBuffer(const char* data, size_t size, std::vector<char>& out);
+        size_t encodeBuffer(const char* data, size_t size, char* out, size_t capacity);
+        size_t decodeBuffer(const char* data, size_t size, std::vector<char>& out);
+        size_t decodeBuffer(const char* data, size_t size, char* out, size_t capacity);
+        // Capacity encodeBuffer needs for size bytes at most with the current settings
+        size_t maxEncodedSize(size_t size) const;
+        // Bytes decodeBuffer writes for the archive, -1 for stream and adaptive archives where only the end tells
+        long long decodedSize(const char* data, size_t size);
 
         void clear();
+        // Bits of the current code of symbol, empty if it has none. Only legacy trees have codes longer
+        // than the 32 bits of EncodeEntry, their leading bits read as zeros.
+        std::vector<bool> code(unsigned char symbol) const;
 
         static const int max_chars = 256;
-        static constexpr int extra_bytes = (1 + max_chars) * sizeof (long long);
-        Node* root = nullptr;
-        std::vector<bool> codes[max_chars];
+        static constexpr int max_nodes = 2 * max_chars - 1;
+        static constexpr int legacy_header_bytes = (1 + max_chars) * sizeof (long long);
+        // Legacy archives start with a non-negative symbol count, newer formats with a negative tag
+        static constexpr long long legacy_format = 0;
+        static constexpr long long canonical_format = -2;
+        static constexpr long long block_format = -3;
+        static constexpr long long stream_format = -4;
+        static constexpr long long interleaved_format = -5;
+        static constexpr long long adaptive_format = -6;
+        static constexpr long long context_format = -7;
+        static constexpr long long trained_format = -8;
+        // Tag of the table files trainTable writes, not an archive format
+        static constexpr long long table_file_format = -9;
+        static const unsigned char stored_block = 0;
+        static const unsigned char huffman_block = 1;
+        static const unsigned char interleaved_block = 2;
+        static const int max_streams = 8;
+        // Symbols coded as one interleaved group in single-table archives, changing it breaks the format
+        static const int interleaved_chunk_size = 1 << 16;
+        static const long long min_block_size = 1 << 10;
+        static const long long max_block_size = 1 << 28;
+        // Block size of stream archives when block_size is not set
+        static const long long default_stream_block_size = 1 << 20;
+        // File name for standard input or output, which are coded as a stream of framed blocks
+        static constexpr const char* standard_stream = "-";
+        static const int min_code_length_limit = 11;
+        static const int max_code_length_limit = 32;
+        static const int default_max_code_length = 15;
+        static const int decode_table_bits = 11;
+        // Pair coding: the longest pair a pair table entry holds, the least input of a table worth building
+        // it for and the highest average code length in bits it is used with
+        static const int max_pair_bits = 32;
+        static const long long min_pair_coding_bytes = 1 << 18;
+        static const int max_pair_code_length = 6;
+        // Multi-symbol decoding: the symbols of an entry, the least output of a table worth building it
+        // for and the highest average code length in bits it is used with
+        static const int max_multi_symbols = sizeof(MultiDecodeEntry::symbols);
+        static const long long min_multi_decoding_bytes = 1 << 12;
+        static const int max_multi_code_length = 5;
+        static const int io_buffer_size = 1 << 16;
+        // Input bytes counted by one thread at a time when building the histogram
+        static const int histogram_chunk_size = 1 << 22;
+        short root = no_node;
+        unsigned char lengths[max_chars];
+        long long extra_bytes = 0;
+        // Longest code the encoder may assign, between min_code_length_limit and max_code_length_limit
+        int max_code_length = default_max_code_length;
+        // Bytes per independently coded block, 0 codes the whole file with a single table
+        long long block_size = 0;
+        // Substreams every table's symbols are dealt into so that they can be decoded side by side:
+        // 1, 2, 4 or max_streams, 1 writes a single serial bitstream
+        int streams = 1;
+        // Code adaptively in a single pass without a table (block_size and streams do not apply)
+        bool adaptive = false;
+        // Pick the table of every byte by the byte before it, from up to ContextModel::max_tables
+        // tables (block_size and streams do not apply)
+        bool context = false;
+        // Table file written by trainTable to code with instead of a table built from the input, archives
+        // then only store its ID. Decoding such archives needs the same file. (block_size and streams do not apply)
+        std::string table_file;
+        // Threads coding blocks concurrently, 0 uses one per hardware thread
+        int threads = 0;
+        // Read input and write decompressed output through memory mappings where the files allow it
+        bool memory_map = false;
+        // Decompressed bytes decodeFile writes: range_length bytes from range_offset, -1 up to the end.
+        // Block archives only decode the blocks holding the range, other formats decode up to its end.
+        long long range_offset = 0;
+        long long range_length = -1;
+        // How encodeFile and decodeFile print the statistics when asked to
+        StatisticsFormat statistics_format = StatisticsFormat::sizes;
+        // Filled in by every encodeFile, decodeFile, encodeBuffer and decodeBuffer call
+        Statistics statistics;
 
 
     private:
 #ifdef MY_TESTS
         public:
 #endif
+        friend class Encoder;
+        friend class Decoder;
+        friend class ContextModel;
+        // Times a whole encode or decode call and fills in the statistics when it returns
+        struct MeasuredCall {
+            MeasuredCall(Tree& tree, bool encoded);
+            ~MeasuredCall();
+            Tree& tree;
+            bool encoded;
+            PhaseTimer timer;
+        };
         long long input_size = 0;
         long long output_size = 0;
-        std::priority_queue<Node*, std::vector<Node*>, NodePtrComp> nodes;
+        Node tree[max_nodes];
+        short node_count = 0;
+        // Binary heap of subtrees waiting to be merged, ordered by NodeComp
+        short heap[max_chars];
+        short heap_size = 0;
         long long entries[max_chars];
         long long count = 0;
-        void loadRawEntries(std::ifstream& in);
+        long long block_count = 0;
+        std::vector<BlockIndexEntry> block_index;
+        long long format = canonical_format;
+        // End of the requested range in decompressed bytes
+        long long range_end = LLONG_MAX;
+        bool lengths_loaded = false;
+        // Trained table last read from a file, kept while table_file names the same file
+        std::string loaded_table_file;
+        unsigned char trained_lengths[max_chars];
+        EncodeEntry trained_table[max_chars];
+        unsigned long long trained_table_id = 0;
+        EncodeEntry encode_table[max_chars];
+        // Codes of two bytes at once, used instead of encode_table when pair_coding is set
+        std::vector<EncodeEntry> pair_table;
+        bool pair_coding = false;
+        std::vector<DecodeEntry> decode_table;
+        // Used instead of decode_table by the serial decoder when multi_decoding is set
+        std::vector<MultiDecodeEntry> multi_decode_table;
+        bool multi_decoding = false;
+        // Substreams of the table being coded, taken from streams or from the archive
+        int stream_count = 1;
+        // Coded substreams of an interleaved group, the decoder reads a whole group into the first one
+        std::vector<char> substreams[max_streams];
+        // Scratch storage of the coders that clear() leaves alone, so that a Tree coding one input
+        // after another stops allocating once its storage fits the largest one, files and block
+        // archives included. Starting worker threads still allocates when threads is above one
+        std::vector<std::array<long long, max_chars>> histograms;
+        std::vector<BitReader> substream_readers;
+        std::vector<char> write_buffer;
+        std::vector<char> read_buffer;
+        std::vector<char> io_buffer;
+        std::vector<char> read_block;
+        // Buffers of the file streams of encodeFile and decodeFile
+        std::vector<char> input_file_buffer;
+        std::vector<char> output_file_buffer;
+        std::vector<Tree> worker_trees;
+        std::vector<BlockSlot> block_slots;
+        // Model of context mode, made on first use; a vector because ContextModel is only declared here
+        std::vector<ContextModel> context_models;
+        ContextModel& contextModel();
+        void loadRawEntries(std::istream& in);
+        void loadRawEntries(const unsigned char* data, size_t size);
+        void countEntries(const unsigned char* data, size_t size);
+        static void countBytes(const unsigned char* data, size_t size, long long* histogram);
         void buildTree();
+        short newNode(long long frequency, short left_child = no_node, short right_child = no_node, unsigned char symbol = 0);
+        void pushLeaf(unsigned char symbol, long long frequency);
         void mergeTree();
-        void encodeAndWriteCompressed (std::ifstream& in, std::ofstream& out);
-        void loadEncodedTree(std::ifstream& in);
-        void decodeAndWriteText(std::ifstream& in, std::ofstream& out);
+        void assignTreeCodes(short v, int depth, unsigned long long prefix);
+        void computeCodeLengths();
+        void limitCodeLengths();
+        void assignCanonicalCodes();
+        long long writeTable(BitWriter& writer);
+        long long readTable(BitReader& reader);
+        void selectPairCoding();
+        void buildPairTable();
+        long long encodeSymbols(const unsigned char* data, size_t size, BitWriter& writer);
+        long long encodePairs(const unsigned char* data, size_t size, BitWriter& writer);
+        long long encodeInterleaved(const unsigned char* data, size_t size, BitWriter& writer);
+        void checkSettings() const;
+        void encodeArchive(std::istream& in, std::ostream& out, const ByteSpan* input = nullptr);
+        void encodeAndWriteCompressed (std::istream& in, std::ostream& out, const ByteSpan* input = nullptr);
+        void encodeBlock(const unsigned char* data, size_t size, BitWriter& writer);
+        void encodeBlocks(std::istream& in, std::ostream& out, const ByteSpan* input = nullptr);
+        void encodeStream(std::istream& in, std::ostream& out);
+        void loadEncodedTree(std::istream& in);
+        void buildDecodeTable();
+        void fillDecodeTable(short v, int depth, unsigned int prefix);
+        unsigned char decodeSymbol(BitReader& reader, long long& total_bits);
+        void selectMultiDecoding();
+        void buildMultiDecodeTable();
+        long long decodeSymbols(BitReader& reader, unsigned char* out, long long size);
+        long long decodeMultiSymbols(BitReader& reader, unsigned char* out, long long size);
+        long long decodeInterleaved(BitReader& reader, unsigned char* out, long long size);
+        template<int streams>
+        long long decodeRounds(BitReader* readers, unsigned char* out, long long size);
+        void writeStreamCount(BitWriter& writer);
+        void readStreamCount(BitReader& reader);
+        void checkRange();
+        void decodeArchive(std::istream& in, std::ostream& out, const ByteSpan* input = nullptr, char* output = nullptr);
+        void decodeAndWriteText(std::istream& in, std::ostream& out, const ByteSpan* input = nullptr, char* output = nullptr);
+        void decodeBlock(BitReader& reader, char* out, long long size);
+        void loadBlockIndex(BitReader& reader, std::istream& in);
+        void decodeBlocks(std::istream& in, std::ostream& out, const ByteSpan* input = nullptr, char* output = nullptr);
+        void decodeStream(std::istream& in, std::ostream& out);
+        void encodeContext(std::istream& in, std::ostream& out, const ByteSpan* input = nullptr);
+        void decodeContext(std::istream& in, std::ostream& out, const ByteSpan* input = nullptr, char* output = nullptr);
+        void encodeAdaptive(std::istream& in, std::ostream& out, const ByteSpan* input = nullptr);
+        void decodeAdaptive(std::istream& in, std::ostream& out, const ByteSpan* input = nullptr);
+        std::streamsize readInput(std::istream& in, char* buffer, std::streamsize size);
+        void loadTrainedTable();
+        static unsigned long long tableId(const unsigned char* lengths);
+        void writeRange(std::ostream& out, const char* data, long long position, long long size);
+        bool countInHeader() const;
+        bool wholeRange() const;
+        int workerThreads() const;
+        int prepareWorkers();
+        static long long payloadBytes(std::istream& in);
+        bool countFits(long long payload) const;
+        void useFileBuffers(std::ifstream& in, std::ofstream& out);
     };
-}
-
-
-
-
-
 
+    // Defined here so that the other table-driven decoders can inline it too
+    inline unsigned char Tree::decodeSymbol(BitReader &reader, long long &total_bits) {
+        reader.refill();
+        const DecodeEntry &entry = decode_table[reader.peek(decode_table_bits)];
+        if (entry.length > reader.available()) throw std::invalid_argument("Unable to read expected bits");
+        if (entry.invalid) throw std::invalid_argument("Invalid bit sequence");
+        reader.consume(entry.length);
+        total_bits += entry.length;
+        if (entry.subtree == no_node)
+            return entry.symbol;
+        short v = entry.subtree;
+        bool bit = false;
+        while (v != no_node && tree[v].left_child != no_node) {
+            if (!(reader >> bit)) throw std::invalid_argument("Unable to read expected bits");
+            v = bit ? tree[v].right_child : tree[v].left_child;
+            total_bits++;
+        }
+        if (v == no_node)
+            throw std::invalid_argument("Invalid bit sequence");
+        return tree[v].symbol;
+    }
+}
 
+// Tree keeps a ContextModel, which needs the complete Tree, so it is defined wherever Tree is
+#include "context_model.h"
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+namespace Huffman {
+
+    // Memory mapping of a whole regular file. Mapping fails (and callers fall back to streams)
+    // for pipes, devices and on platforms without mmap.
+    class MappedFile {
+    public:
+        MappedFile() = default;
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile();
+
+        // Maps an existing regular file read-only with sequential access hints
+        bool mapInput(const std::string& file_name);
+        // Truncates or creates a regular file of exactly size bytes and maps it for writing
+        bool mapOutput(const std::string& file_name, size_t size);
+        void close();
+
+        char* data() const {
+            return address;
+        }
+        size_t size() const {
+            return length;
+        }
+
+    private:
+        bool map(int fd, size_t size, bool writable);
+        char* address = nullptr;
+        size_t length = 0;
+    };
+}
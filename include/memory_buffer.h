@@ -0,0 +1,38 @@
+#pragma once
+
+#include <streambuf>
+#include <vector>
+
+namespace Huffman {
+
+    // Stream buffer over memory owned by the caller, so that the stream coders can work on buffers.
+    // Reads and writes are seekable within the memory. A fixed buffer fails writes past its capacity,
+    // a vector grows instead.
+    class MemoryBuffer : public std::streambuf {
+    public:
+        // Reads size bytes at data
+        MemoryBuffer(const char* data, size_t size);
+        // Writes into capacity bytes at data
+        MemoryBuffer(char* data, size_t capacity);
+        // Writes into sink, which is emptied first but keeps its capacity
+        explicit MemoryBuffer(std::vector<char>& sink);
+
+        // Bytes written up to the furthest position
+        size_t size() const {
+            return written;
+        }
+
+    protected:
+        std::streamsize xsputn(const char* s, std::streamsize n) override;
+        int_type overflow(int_type c) override;
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+    private:
+        char* out = nullptr;
+        size_t capacity = 0;
+        std::vector<char>* sink = nullptr;
+        size_t position = 0;
+        size_t written = 0;
+    };
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace Huffman {
+
+    // Runs task(index, worker) for every index in [0, count) on up to threads threads.
+    // worker is in [0, threads) and never runs two tasks at once, so it can pick per-thread state.
+    // The first exception thrown by a task is rethrown once all threads have finished.
+    template<class Task>
+    void parallelFor(size_t count, int threads, Task task) {
+        threads = (int) std::min<size_t>(std::max(threads, 1), count);
+        if (threads <= 1) {
+            for (size_t i = 0; i < count; i++)
+                task(i, 0);
+            return;
+        }
+        std::atomic<size_t> next(0);
+        std::vector<std::exception_ptr> errors(threads);
+        std::vector<std::thread> workers;
+        for (int worker = 0; worker < threads; worker++) {
+            workers.emplace_back([&, worker]() {
+                try {
+                    for (size_t i = next++; i < count; i = next++)
+                        task(i, worker);
+                }
+                catch (...) {
+                    errors[worker] = std::current_exception();
+                    next = count;
+                }
+            });
+        }
+        for (auto &t: workers)
+            t.join();
+        for (auto &e: errors)
+            if (e) std::rethrow_exception(e);
+    }
+
+    inline int hardwareThreads() {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+}
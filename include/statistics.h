@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <ctime>
+#include <ostream>
+#include <string>
+
+namespace Huffman {
+
+    enum class StatisticsFormat {
+        sizes, // the three sizes the program has always printed
+        json, // one JSON object
+        key_value // one key=value pair per line
+    };
+
+    // The format named json or kv on the command line, other names are invalid arguments
+    StatisticsFormat parseStatisticsFormat(const std::string& name);
+
+    // Seconds spent in a phase. Phases that ran on several threads add up the time of every thread.
+    struct PhaseTime {
+        double wall = 0;
+        double cpu = 0;
+
+        PhaseTime& operator+=(const PhaseTime& other) {
+            wall += other.wall;
+            cpu += other.cpu;
+            return *this;
+        }
+    };
+
+    // What a Tree did in its last encode or decode call
+    struct Statistics {
+        long long input_bytes = 0; // bytes read, the archive when decoding
+        long long output_bytes = 0; // bytes written, the archive when encoding
+        long long header_bytes = 0; // of the archive: tags, tables, indices and frame headers
+        long long data_bytes = 0; // uncompressed bytes coded or decoded
+        double code_length = 0; // average bits per uncompressed byte of the archive without headers
+        double entropy = -1; // order-0 entropy in bits per byte of the counted histograms, -1 if none was counted
+        long long peak_memory = 0; // largest resident set of the process in bytes, 0 where unknown
+        PhaseTime histogram; // counting bytes
+        PhaseTime tree; // building codes and decode tables
+        PhaseTime coding; // coding and decoding symbols, including the buffered reads and writes of the coders
+        PhaseTime io; // reading the input to encode and writing the decoded output
+        PhaseTime total; // the whole call, CPU time of all threads
+
+        // Entropy of one more histogram, merged with the ones added before
+        void addHistogram(const long long* histogram, int symbols);
+        // Adds the phases and histograms of another tree, such as a worker's
+        void addPhases(const Statistics& other);
+        // Fills in the sizes and the derived values at the end of a call, encoded tells whether the
+        // archive was the output
+        void finish(long long input, long long output, long long header, long long data, bool encoded);
+        // As JSON or key=value pairs, Tree prints the sizes format itself
+        void write(std::ostream& out, StatisticsFormat format) const;
+
+    private:
+        double entropy_bits = 0;
+        long long counted_bytes = 0;
+    };
+
+    // Adds the wall and CPU time of the calling thread, or of the whole process, from construction
+    // to destruction to a phase
+    class PhaseTimer {
+    public:
+        explicit PhaseTimer(PhaseTime& phase, bool whole_process = false);
+        ~PhaseTimer();
+        PhaseTimer(const PhaseTimer&) = delete;
+        PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+    private:
+        PhaseTime& phase;
+        bool whole_process;
+        std::chrono::steady_clock::time_point wall_start;
+        double cpu_start;
+    };
+
+    // Peak resident set size of the process in bytes, 0 where the platform does not tell
+    long long peakMemory();
+}
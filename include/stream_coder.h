@@ -0,0 +1,55 @@
+#pragma once
+
+#include "huffman.h"
+
+namespace Huffman {
+
+    // Compresses data handed over in pieces of any size into a stream archive (Tree::stream_format).
+    // Every full block is coded as soon as it is complete and its frame appended to the caller's output,
+    // so only the unfinished block is kept.
+    class Encoder {
+    public:
+        // Appends size bytes to the archive, out receives the frames of the blocks this completes
+        void update(const char* data, size_t size, std::vector<char>& out);
+        // Codes the unfinished block now, so that everything given so far can be decoded from out
+        void flush(std::vector<char>& out);
+        // Flushes and ends the archive, the encoder takes no more data afterwards
+        void finish(std::vector<char>& out);
+
+        // Settings as in Tree, read when the first data arrives. Block size 0 takes the default.
+        long long block_size = Tree::default_stream_block_size;
+        int max_code_length = Tree::default_max_code_length;
+        int streams = 1;
+
+    private:
+        void start(std::vector<char>& out);
+        void writeFrame(const char* data, size_t size, std::vector<char>& out);
+        Tree tree;
+        std::vector<char> pending;
+        bool started = false;
+        bool finished = false;
+    };
+
+    // Decompresses a stream archive handed over in pieces of any size. Blocks are decoded once
+    // all of their frame has arrived and as their bytes are asked for.
+    class Decoder {
+    public:
+        // Adds size bytes of the archive
+        void update(const char* data, size_t size);
+        // Copies up to capacity decompressed bytes to out and returns how many. 0 means that more
+        // of the archive is needed, or that it is finished.
+        size_t read(char* out, size_t capacity);
+        // The end of the archive has been seen and all of its bytes were read
+        bool finished() const;
+
+    private:
+        bool decodeFrame();
+        Tree tree;
+        std::vector<char> input;
+        size_t input_position = 0;
+        std::vector<char> decoded;
+        size_t decoded_position = 0;
+        bool started = false;
+        bool ended = false;
+    };
+}
@@ -0,0 +1,126 @@
+#include "adaptive_model.h"
+#include <algorithm>
+
+namespace Huffman {
+
+    AdaptiveModel::AdaptiveModel() {
+        reset();
+    }
+
+    void AdaptiveModel::reset() {
+        nodes[0] = AdaptiveNode();
+        node_count = 1;
+        nyt = 0;
+        std::fill(leaves, leaves + Tree::max_chars, no_node);
+    }
+
+    // Writes the path from the root to v, collected from v upwards
+    int AdaptiveModel::writePath(short v, BitWriter &writer) {
+        bool path[max_nodes];
+        int depth = 0;
+        for (; v != 0; v = nodes[v].parent)
+            path[depth++] = nodes[nodes[v].parent].right_child == v;
+        int length = depth;
+        while (depth > 0) {
+            int n = depth < BitWriter::max_code_bits ? depth : BitWriter::max_code_bits;
+            unsigned long long code = 0;
+            for (int i = 0; i < n; i++)
+                code = code << 1 | path[--depth];
+            writer.write(code, n);
+        }
+        return length;
+    }
+
+    int AdaptiveModel::encode(unsigned char symbol, BitWriter &writer) {
+        short v = leaves[symbol];
+        if (v != no_node) {
+            int length = writePath(v, writer);
+            update(v);
+            return length;
+        }
+        int length = writePath(nyt, writer);
+        writer.write(symbol, byte_size + 1); // a 0 bit, then the symbol
+        update(addSymbol(symbol));
+        return length + byte_size + 1;
+    }
+
+    int AdaptiveModel::encodeEnd(BitWriter &writer) {
+        int length = writePath(nyt, writer);
+        writer.write(1, 1);
+        return length + 1;
+    }
+
+    bool AdaptiveModel::decode(BitReader &reader, unsigned char &symbol, long long &total_bits) {
+        short v = 0;
+        bool bit = false;
+        while (nodes[v].left_child != no_node) {
+            if (!(reader >> bit)) throw std::invalid_argument("Unable to read expected bits");
+            v = bit ? nodes[v].right_child : nodes[v].left_child;
+            total_bits++;
+        }
+        if (v != nyt) {
+            symbol = nodes[v].symbol;
+            update(v);
+            return true;
+        }
+        if (!(reader >> bit)) throw std::invalid_argument("Unable to read expected bits");
+        total_bits++;
+        if (bit) return false;
+        symbol = 0;
+        for (int i = 0; i < byte_size; i++) {
+            if (!(reader >> bit)) throw std::invalid_argument("Unable to read expected bits");
+            symbol = symbol << 1 | bit;
+        }
+        total_bits += byte_size;
+        if (leaves[symbol] != no_node) throw std::invalid_argument("Invalid bit sequence");
+        update(addSymbol(symbol));
+        return true;
+    }
+
+    // NYT becomes the parent of a new NYT and of a leaf for symbol, both of weight 0
+    short AdaptiveModel::addSymbol(unsigned char symbol) {
+        short leaf = node_count, new_nyt = node_count + 1;
+        node_count += 2;
+        nodes[leaf] = AdaptiveNode{0, nyt, no_node, no_node, symbol};
+        nodes[new_nyt] = AdaptiveNode{0, nyt, no_node, no_node, 0};
+        nodes[nyt].left_child = new_nyt;
+        nodes[nyt].right_child = leaf;
+        nyt = new_nyt;
+        leaves[symbol] = leaf;
+        return leaf;
+    }
+
+    // Moves every node on the way to the root to the front of its weight block before incrementing it,
+    // which keeps the weights ordered along the array
+    void AdaptiveModel::update(short v) {
+        while (v != no_node) {
+            short leader = v;
+            while (leader > 0 && nodes[leader - 1].weight == nodes[v].weight)
+                leader--;
+            if (leader != v && leader != nodes[v].parent) {
+                swapNodes(v, leader);
+                v = leader;
+            }
+            nodes[v].weight++;
+            v = nodes[v].parent;
+        }
+    }
+
+    // Exchanges the subtrees at positions a and b, parents keep pointing at the same positions
+    void AdaptiveModel::swapNodes(short a, short b) {
+        std::swap(nodes[a].weight, nodes[b].weight);
+        std::swap(nodes[a].left_child, nodes[b].left_child);
+        std::swap(nodes[a].right_child, nodes[b].right_child);
+        std::swap(nodes[a].symbol, nodes[b].symbol);
+        if (nyt == a || nyt == b)
+            nyt = nyt == a ? b : a;
+        for (short v: {a, b}) {
+            if (nodes[v].left_child != no_node) {
+                nodes[nodes[v].left_child].parent = v;
+                nodes[nodes[v].right_child].parent = v;
+            } else if (v != nyt) {
+                leaves[nodes[v].symbol] = v;
+            }
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#include "benchmark.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iterator>
+
+namespace Huffman {
+
+    namespace {
+        PhaseSpeed summarize(const std::vector<double>& speeds) {
+            PhaseSpeed speed;
+            for (double s: speeds) {
+                speed.mean += s / speeds.size();
+                speed.best = std::max(speed.best, s);
+            }
+            for (double s: speeds)
+                speed.deviation += (s - speed.mean) * (s - speed.mean) / speeds.size();
+            speed.deviation = std::sqrt(speed.deviation);
+            return speed;
+        }
+
+        template<class Phase>
+        double megabytesPerSecond(long long bytes, Phase phase) {
+            auto start = std::chrono::steady_clock::now();
+            phase();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            return bytes / std::max(elapsed.count(), 1e-9) / 1e6;
+        }
+    }
+
+    Benchmark::Benchmark(const std::string &file_name) {
+        std::ifstream in(file_name, std::ios::binary);
+        if (!in) throw std::invalid_argument("Unable to open input file");
+        data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    BenchmarkResult Benchmark::run(Tree &tree, int iterations) {
+        if (iterations < 1) throw std::invalid_argument("Invalid iteration count");
+        BenchmarkResult result;
+        result.input_bytes = data.size();
+        result.iterations = iterations;
+        std::vector<double> compress, decompress;
+        for (int i = 0; i < iterations; i++) {
+            compress.push_back(megabytesPerSecond(data.size(), [&] {
+                result.archive_bytes = tree.encodeBuffer(data.data(), data.size(), archive);
+            }));
+            decompress.push_back(megabytesPerSecond(data.size(), [&] {
+                tree.decodeBuffer(archive.data(), archive.size(), decoded);
+            }));
+            if (decoded != data) throw std::invalid_argument("Decompressed data differs from the input");
+        }
+        result.compress = summarize(compress);
+        result.decompress = summarize(decompress);
+        return result;
+    }
+
+    void Benchmark::print(std::ostream &out, const Tree &tree, const BenchmarkResult &result) {
+        auto phase = [&out](const char *name, const PhaseSpeed &speed) {
+            out << " " << name << " " << speed.mean << " MB/s +-" << speed.deviation << " (best " << speed.best << ")";
+        };
+        std::ios_base::fmtflags flags = out.flags();
+        out << std::fixed << std::setprecision(1) << "block-size " << tree.block_size << " threads " << tree.threads
+            << " max-code-length " << tree.max_code_length << " streams " << tree.streams << std::setprecision(4)
+            << " ratio " << (result.input_bytes ? (double) result.archive_bytes / result.input_bytes : 0)
+            << " iterations " << result.iterations << std::setprecision(1);
+        phase("compress", result.compress);
+        phase("decompress", result.decompress);
+        out << std::endl;
+        out.flags(flags);
+    }
+}
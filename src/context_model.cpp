@@ -0,0 +1,207 @@
+#include "context_model.h"
+#include <algorithm>
+#include <cmath>
+
+namespace Huffman {
+
+    namespace {
+        // Estimated bits of a group coded with its own table: the entropy of its bytes plus the table
+        double groupBits(const std::array<long long, Tree::max_chars>& histogram) {
+            long long total = 0;
+            int symbols = 0;
+            for (long long n: histogram) {
+                total += n;
+                symbols += n != 0;
+            }
+            double bits = (sizeof(long long) + sizeof(unsigned short) + 2 * symbols) * byte_size;
+            for (long long n: histogram)
+                if (n != 0)
+                    bits += n * std::log2((double) total / n);
+            return bits;
+        }
+    }
+
+    ContextModel::ContextModel() : histograms(Tree::max_chars) {
+        reset();
+    }
+
+    void ContextModel::reset() {
+        for (auto& histogram: histograms)
+            histogram.fill(0);
+        std::fill(context_map, context_map + Tree::max_chars, 0);
+        restart();
+    }
+
+    // Tables are reused with the storage their last input left them, and only added when there are more
+    void ContextModel::useTables(size_t table_count) {
+        tables.resize(table_count);
+        for (auto& table: tables)
+            table.clear();
+    }
+
+    void ContextModel::count(const unsigned char *data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            histograms[previous][data[i]]++;
+            previous = data[i];
+        }
+    }
+
+    void ContextModel::build(int max_code_length) {
+        cluster();
+        for (auto& table: tables) {
+            table.max_code_length = max_code_length;
+            table.buildTree();
+        }
+        restart();
+    }
+
+    // Greedy agglomerative clustering: the two groups whose merge costs the fewest estimated bits are
+    // merged while that saves bits (a table less to store) or while there are more than max_tables.
+    // Only the costs of the merged group are recomputed after every merge.
+    void ContextModel::cluster() {
+        groups.clear();
+        for (int c = 0; c < Tree::max_chars; c++)
+            if (std::any_of(histograms[c].begin(), histograms[c].end(), [](long long n) { return n != 0; }))
+                groups.push_back(c);
+        int n = groups.size();
+        merged.assign(histograms.begin(), histograms.end());
+        owner.resize(Tree::max_chars);
+        for (int c = 0; c < Tree::max_chars; c++)
+            owner[c] = c;
+        bits.assign(Tree::max_chars, 0);
+        // the costs of merging group i with a later group j, row by row
+        delta.assign(n * n, 0);
+        auto cost = [&](int i, int j) -> double & { return delta[i * n + j]; };
+        auto mergeCost = [&](int a, int b) {
+            std::array<long long, Tree::max_chars> sum;
+            for (int s = 0; s < Tree::max_chars; s++)
+                sum[s] = merged[a][s] + merged[b][s];
+            return groupBits(sum) - bits[a] - bits[b];
+        };
+        for (int i = 0; i < n; i++)
+            bits[groups[i]] = groupBits(merged[groups[i]]);
+        for (int i = 0; i < n; i++)
+            for (int j = i + 1; j < n; j++)
+                cost(i, j) = mergeCost(groups[i], groups[j]);
+
+        alive.assign(n, true);
+        int alive_count = n;
+        while (alive_count > 1) {
+            int best_i = -1, best_j = -1;
+            for (int i = 0; i < n; i++) {
+                if (!alive[i]) continue;
+                for (int j = i + 1; j < n; j++)
+                    if (alive[j] && (best_i < 0 || cost(i, j) < cost(best_i, best_j))) {
+                        best_i = i;
+                        best_j = j;
+                    }
+            }
+            // going down to one table also saves the map
+            double saved = alive_count == 2 ? map_bytes * byte_size : 0;
+            if (cost(best_i, best_j) >= saved && alive_count <= max_tables)
+                break;
+            int a = groups[best_i], b = groups[best_j];
+            for (int s = 0; s < Tree::max_chars; s++)
+                merged[a][s] += merged[b][s];
+            bits[a] = groupBits(merged[a]);
+            for (int c = 0; c < Tree::max_chars; c++)
+                if (owner[c] == b)
+                    owner[c] = a;
+            alive[best_j] = false;
+            alive_count--;
+            for (int k = 0; k < n; k++) {
+                if (!alive[k] || k == best_i) continue;
+                (k < best_i ? cost(k, best_i) : cost(best_i, k)) = mergeCost(a, groups[k]);
+            }
+        }
+
+        useTables(alive_count);
+        table_of.assign(Tree::max_chars, -1);
+        for (int i = 0, next = 0; i < n; i++) {
+            if (!alive[i]) continue;
+            table_of[groups[i]] = next;
+            Tree &table = tables[next++];
+            std::copy(merged[groups[i]].begin(), merged[groups[i]].end(), table.entries);
+            for (long long entry: merged[groups[i]])
+                table.count += entry;
+        }
+        for (int c = 0; c < Tree::max_chars; c++)
+            context_map[c] = table_of[owner[c]] < 0 ? 0 : table_of[owner[c]];
+    }
+
+    // The groups of two contexts share a byte, and with a single table there is no map at all
+    long long ContextModel::writeHeader(BitWriter &writer) {
+        unsigned char table_count = tables.size();
+        writer << table_count;
+        long long bytes = sizeof(table_count);
+        if (table_count > 1) {
+            for (int c = 0; c < Tree::max_chars; c += 2) {
+                unsigned char pair = context_map[c] << 4 | context_map[c + 1];
+                writer << pair;
+            }
+            bytes += map_bytes;
+        }
+        for (auto &table: tables)
+            bytes += table.writeTable(writer);
+        return bytes;
+    }
+
+    // The tables must account for exactly count bytes, none of them empty
+    long long ContextModel::readHeader(BitReader &reader, long long count) {
+        unsigned char table_count;
+        if (!(reader >> table_count) || table_count > max_tables || (table_count == 0) != (count == 0))
+            throw std::invalid_argument("Header data not found");
+        long long bytes = sizeof(table_count), total = 0;
+        std::fill(context_map, context_map + Tree::max_chars, 0);
+        if (table_count > 1) {
+            for (int c = 0; c < Tree::max_chars; c += 2) {
+                unsigned char pair;
+                if (!(reader >> pair)) throw std::invalid_argument("Header data not found");
+                context_map[c] = pair >> 4;
+                context_map[c + 1] = pair & 15;
+                if (context_map[c] >= table_count || context_map[c + 1] >= table_count)
+                    throw std::invalid_argument("Header data not found");
+            }
+            bytes += map_bytes;
+        }
+        useTables(table_count);
+        for (auto &table: tables) {
+            bytes += table.readTable(reader);
+            // the encoder only writes tables of contexts that occur, an empty one would decode every code as length 0
+            if (table.count == 0) throw std::invalid_argument("Header data not found");
+            total += table.count;
+            table.buildTree();
+            if (table.count > 0 && table.root == no_node)
+                throw std::invalid_argument("Invalid bit sequence");
+            table.buildDecodeTable();
+        }
+        if (total != count) throw std::invalid_argument("Block sizes do not match the header");
+        restart();
+        return bytes;
+    }
+
+    void ContextModel::restart() {
+        previous = 0;
+    }
+
+    long long ContextModel::encode(const unsigned char *data, size_t size, BitWriter &writer) {
+        long long total_bits = 0;
+        for (size_t i = 0; i < size; i++) {
+            const Tree &table = tables[context_map[previous]];
+            const EncodeEntry &entry = table.encode_table[data[i]];
+            writer.write(entry.code, entry.length);
+            total_bits += entry.length;
+            previous = data[i];
+        }
+        return total_bits;
+    }
+
+    long long ContextModel::decode(BitReader &reader, unsigned char *out, long long size) {
+        long long total_bits = 0;
+        for (long long i = 0; i < size; i++) {
+            out[i] = tables[context_map[previous]].decodeSymbol(reader, total_bits);
+            previous = out[i];
+        }
+        return total_bits;
+    }
+}
@@ -1,141 +1,1414 @@
 #include "huffman.h"
+#include "parallel.h"
+#include "mapped_file.h"
+#include "memory_buffer.h"
+#include "adaptive_model.h"
+#include "context_model.h"
 #include <utility>
 #include <algorithm>
+#include <array>
+#include <optional>
+#include <cmath>
+#include <iterator>
+#include <cstdio>
 #include "iostream"
 
 namespace Huffman {
 
     void Tree::buildTree() {
+        PhaseTimer timer(statistics.tree);
+        if (!lengths_loaded) {
+            statistics.addHistogram(entries, max_chars);
+            if (format == legacy_format) {
+                // the tree itself is the format, its codes are used as they are
+                node_count = 0;
+                for (int i = 0; i < max_chars; i++) {
+                    if (entries[i] != 0) {
+                        pushLeaf(i, entries[i]);
+                    }
+                }
+                mergeTree();
+                return;
+            }
+            computeCodeLengths();
+            if (*std::max_element(lengths, lengths + max_chars) > max_code_length)
+                limitCodeLengths();
+        }
+        assignCanonicalCodes();
+    }
+
+    // In-place Moffat-Katajainen over the frequencies sorted in increasing order. The first pass merges
+    // like Huffman's algorithm with two queues, the leaves not taken yet and the internal nodes made so
+    // far, each internal node keeping the index of its parent in place of its weight once it is merged.
+    // The second pass turns parent indices into depths, the third counts the leaves on every level.
+    void Tree::computeCodeLengths() {
+        unsigned char symbols[max_chars];
+        int n = 0;
+        for (int i = 0; i < max_chars; i++)
+            if (entries[i] != 0)
+                symbols[n++] = i;
+        std::fill(lengths, lengths + max_chars, 0);
+        if (n < 2) {
+            if (n == 1) lengths[symbols[0]] = 1;
+            return;
+        }
+        std::sort(symbols, symbols + n, [this](unsigned char a, unsigned char b) {
+            return entries[a] < entries[b] || (entries[a] == entries[b] && a < b);
+        });
+
+        long long a[max_chars];
+        for (int i = 0; i < n; i++)
+            a[i] = entries[symbols[i]];
+        a[0] += a[1];
+        int root = 0, leaf = 2;
+        for (int next = 1; next < n - 1; next++) {
+            if (leaf >= n || a[root] < a[leaf]) {
+                a[next] = a[root];
+                a[root++] = next;
+            } else {
+                a[next] = a[leaf++];
+            }
+            if (leaf >= n || (root < next && a[root] < a[leaf])) {
+                a[next] += a[root];
+                a[root++] = next;
+            } else {
+                a[next] += a[leaf++];
+            }
+        }
+
+        a[n - 2] = 0;
+        for (int next = n - 3; next >= 0; next--)
+            a[next] = a[a[next]] + 1;
+
+        int available = 1, used = 0, depth = 0, next = n - 1;
+        root = n - 2;
+        while (available > 0) {
+            while (root >= 0 && a[root] == depth) {
+                used++;
+                root--;
+            }
+            while (available > used) {
+                a[next--] = depth;
+                available--;
+            }
+            available = 2 * used;
+            depth++;
+            used = 0;
+        }
+        for (int i = 0; i < n; i++)
+            lengths[symbols[i]] = a[i];
+    }
+
+    // Package-merge: level 1 holds the symbols sorted by frequency, every next level merges them
+    // with pairs of adjacent items of the previous one. The cheapest 2n - 2 items of the last level
+    // are optimal, and a symbol's code length is the number of selected items it takes part in.
+    void Tree::limitCodeLengths() {
+        unsigned char symbols[max_chars];
+        int n = 0;
+        for (int i = 0; i < max_chars; i++)
+            if (entries[i] != 0)
+                symbols[n++] = i;
+        std::fill(lengths, lengths + max_chars, 0);
+        if (n < 2) {
+            if (n == 1) lengths[symbols[0]] = 1;
+            return;
+        }
+        std::sort(symbols, symbols + n, [this](unsigned char a, unsigned char b) {
+            return entries[a] < entries[b];
+        });
+
+        static const int max_items = 2 * max_chars;
+        long long weight[2][max_items];
+        bool is_leaf[max_code_length_limit][max_items];
+        int size = n;
+        for (int i = 0; i < n; i++) {
+            weight[0][i] = entries[symbols[i]];
+            is_leaf[0][i] = true;
+        }
+        for (int level = 1; level < max_code_length; level++) {
+            const long long *previous = weight[(level - 1) % 2];
+            long long *current = weight[level % 2];
+            int packages = size / 2, leaf = 0, package = 0;
+            size = n + packages;
+            for (int i = 0; i < size; i++) {
+                long long package_weight = package < packages ? previous[2 * package] + previous[2 * package + 1] : 0;
+                if (package == packages || (leaf < n && entries[symbols[leaf]] <= package_weight)) {
+                    current[i] = entries[symbols[leaf++]];
+                    is_leaf[level][i] = true;
+                } else {
+                    current[i] = package_weight;
+                    package++;
+                    is_leaf[level][i] = false;
+                }
+            }
+        }
+
+        int selected = 2 * n - 2;
+        for (int level = max_code_length - 1; level >= 0; level--) {
+            int leaves = 0;
+            for (int i = 0; i < selected; i++)
+                leaves += is_leaf[level][i];
+            for (int i = 0; i < leaves; i++)
+                lengths[symbols[i]]++;
+            selected = 2 * (selected - leaves);
+        }
+    }
+
+    void Tree::assignCanonicalCodes() {
+        unsigned char symbols[max_chars];
+        int n = 0;
         for (int i = 0; i < max_chars; i++) {
-            if (entries[i] != 0) {
-                nodes.push(new Node({(unsigned char) i}, entries[i]));
+            encode_table[i] = EncodeEntry();
+            if (lengths[i] != 0)
+                symbols[n++] = i;
+        }
+        // the symbols are in order already, so breaking ties by value sorts as stably as stable_sort
+        // without its temporary buffer
+        std::sort(symbols, symbols + n, [this](unsigned char a, unsigned char b) {
+            return lengths[a] < lengths[b] || (lengths[a] == lengths[b] && a < b);
+        });
+        node_count = 0;
+        root = no_node;
+        if (n == 0) return;
+
+        // Each code is the previous one plus one, padded with zeros up to its own length
+        unsigned long long code = 0;
+        int length = lengths[symbols[0]];
+        root = newNode(0);
+        for (int i = 0; i < n; i++) {
+            if (i != 0) {
+                if (++code >> length) throw std::invalid_argument("Invalid code lengths");
+                code <<= lengths[symbols[i]] - length;
+                length = lengths[symbols[i]];
+            }
+            encode_table[symbols[i]] = EncodeEntry{(unsigned int) code, (unsigned char) length};
+
+            short v = root;
+            for (int k = length - 1; k >= 0; k--) {
+                bool bit = (code >> k) & 1;
+                short child = bit ? tree[v].right_child : tree[v].left_child;
+                if (child == no_node) {
+                    if (node_count == max_nodes) throw std::invalid_argument("Invalid code lengths");
+                    child = newNode(0, no_node, no_node, symbols[i]);
+                    (bit ? tree[v].right_child : tree[v].left_child) = child;
+                }
+                v = child;
             }
         }
-        mergeTree();
+    }
 
+    short Tree::newNode(long long frequency, short left_child, short right_child, unsigned char symbol) {
+        tree[node_count] = Node{frequency, left_child, right_child, symbol};
+        return node_count++;
     }
 
+    void Tree::pushLeaf(unsigned char symbol, long long frequency) {
+        heap[heap_size++] = newNode(frequency, no_node, no_node, symbol);
+        std::push_heap(heap, heap + heap_size, NodeComp{tree});
+    }
+
+    // Ties are broken exactly as std::priority_queue did, legacy archives depend on the resulting tree
     void Tree::mergeTree() {
-        if (nodes.empty()) return;
+        NodeComp comp{tree};
+        if (heap_size == 0) return;
+
+        if (heap_size == 1) {
+            short v = heap[--heap_size];
+            root = newNode(tree[v].frequency, v, no_node, tree[v].symbol);
+            lengths[tree[v].symbol] = 1;
+            encode_table[tree[v].symbol] = EncodeEntry{0, 1};
+            return;
+        }
 
-        if (nodes.size() == 1) {
-            Node *v = nodes.top();
-            nodes.pop();
-            root = new Node(v->chars, v->frequency, v, nullptr);
-            codes[v->chars.front()].push_back(0);
+        while (heap_size > 1) {
+            std::pop_heap(heap, heap + heap_size--, comp);
+            short v = heap[heap_size];
+            std::pop_heap(heap, heap + heap_size--, comp);
+            short u = heap[heap_size];
+            heap[heap_size++] = newNode(tree[v].frequency + tree[u].frequency, v, u);
+            std::push_heap(heap, heap + heap_size, comp);
+        }
+        root = heap[--heap_size];
+        assignTreeCodes(root, 0, 0);
+    }
+
+    // Codes of legacy trees can be longer than EncodeEntry holds, their lengths are kept in full
+    void Tree::assignTreeCodes(short v, int depth, unsigned long long prefix) {
+        if (tree[v].left_child == no_node) {
+            lengths[tree[v].symbol] = depth;
+            encode_table[tree[v].symbol] = EncodeEntry{(unsigned int) prefix, (unsigned char) depth};
             return;
         }
+        assignTreeCodes(tree[v].left_child, depth + 1, prefix << 1);
+        assignTreeCodes(tree[v].right_child, depth + 1, (prefix << 1) | 1);
+    }
+
+    long long Tree::writeTable(BitWriter &writer) {
+        unsigned short symbols = max_chars - std::count(lengths, lengths + max_chars, 0);
+        writer << count << symbols;
+        for (int i = 0; i < max_chars; i++) {
+            if (lengths[i] == 0) continue;
+            unsigned char c = i;
+            writer << c << lengths[i];
+        }
+        return sizeof(count) + sizeof(symbols) + 2 * symbols;
+    }
 
-        while (nodes.size() > 1) {
-            Node *v = nodes.top();
-            nodes.pop();
-            Node *u = nodes.top();
-            nodes.pop();
-            auto united_chars = v->chars;
-            united_chars.insert(united_chars.end(), u->chars.begin(), u->chars.end());
-            nodes.push(new Node(united_chars, v->frequency + u->frequency, v, u));
-            for (auto c: v->chars) {
-                codes[c].push_back(0);
+    long long Tree::readTable(BitReader &reader) {
+        unsigned short symbols;
+        if (!(reader >> count >> symbols) || count < 0 || symbols > max_chars)
+            throw std::invalid_argument("Header data not found");
+        std::fill(lengths, lengths + max_chars, 0);
+        for (int i = 0; i < symbols; i++) {
+            unsigned char c, length;
+            if (!(reader >> c >> length)) throw std::invalid_argument("Header data not found");
+            if (length == 0 || length > max_code_length_limit || lengths[c] != 0)
+                throw std::invalid_argument("Invalid code lengths");
+            lengths[c] = length;
+        }
+        lengths_loaded = true;
+        return sizeof(count) + sizeof(symbols) + 2 * symbols;
+    }
+
+    // The pair table pays for its 64K entries only on enough input, and only when most pairs fit
+    // in one entry. Decided once per table, block mode decides for every block.
+    void Tree::selectPairCoding() {
+        long long bits = 0;
+        for (int i = 0; i < max_chars; i++)
+            bits += entries[i] * lengths[i];
+        pair_coding = count >= min_pair_coding_bytes && bits <= max_pair_code_length * count;
+        if (pair_coding)
+            buildPairTable();
+    }
+
+    // Entry a * 256 + b codes byte a followed by byte b, a zero length marks pairs longer than an entry holds
+    void Tree::buildPairTable() {
+        PhaseTimer timer(statistics.tree);
+        pair_table.resize(max_chars * max_chars);
+        for (int a = 0; a < max_chars; a++) {
+            const EncodeEntry &first = encode_table[a];
+            EncodeEntry *row = pair_table.data() + a * max_chars;
+            for (int b = 0; b < max_chars; b++) {
+                const EncodeEntry &second = encode_table[b];
+                int length = first.length + second.length;
+                if (first.length == 0 || second.length == 0 || length > max_pair_bits)
+                    row[b] = EncodeEntry();
+                else
+                    row[b] = EncodeEntry{(unsigned int) ((unsigned long long) first.code << second.length | second.code),
+                                         (unsigned char) length};
             }
-            for (auto c: u->chars) {
-                codes[c].push_back(1);
+        }
+    }
+
+    long long Tree::encodeSymbols(const unsigned char *data, size_t size, BitWriter &writer) {
+        if (pair_coding)
+            return encodePairs(data, size, writer);
+        PhaseTimer timer(statistics.coding);
+        long long total_bits = 0;
+        for (size_t i = 0; i < size; i++) {
+            const EncodeEntry &entry = encode_table[data[i]];
+            writer.write(entry.code, entry.length);
+            total_bits += entry.length;
+        }
+        return total_bits;
+    }
+
+    long long Tree::encodePairs(const unsigned char *data, size_t size, BitWriter &writer) {
+        PhaseTimer timer(statistics.coding);
+        long long total_bits = 0;
+        size_t i = 0;
+        for (; i + 2 <= size; i += 2) {
+            const EncodeEntry &pair = pair_table[data[i] << byte_size | data[i + 1]];
+            if (pair.length != 0) {
+                writer.write(pair.code, pair.length);
+                total_bits += pair.length;
+            } else {
+                const EncodeEntry &first = encode_table[data[i]], &second = encode_table[data[i + 1]];
+                writer.write(first.code, first.length);
+                writer.write(second.code, second.length);
+                total_bits += first.length + second.length;
             }
         }
-        for (auto &code : codes) {
-            std::reverse(code.begin(), code.end());
+        if (i < size) {
+            writer.write(encode_table[data[i]].code, encode_table[data[i]].length);
+            total_bits += encode_table[data[i]].length;
         }
-        root = nodes.top();
-        nodes.pop();
+        return total_bits;
     }
 
-    Tree::~Tree() {
-        delete root;
+    // Deals symbol i of the group to substream i % stream_count and writes the byte size of every
+    // substream before the substreams themselves. Returns the coded bits including padding.
+    long long Tree::encodeInterleaved(const unsigned char *data, size_t size, BitWriter &writer) {
+        PhaseTimer timer(statistics.coding);
+        for (int s = 0; s < stream_count; s++)
+            substreams[s].clear();
+        std::optional<BitWriter> writers[max_streams];
+        for (int s = 0; s < stream_count; s++)
+            writers[s].emplace(substreams[s]);
+        size_t i = 0;
+        for (; i + stream_count <= size; i += stream_count)
+            for (int s = 0; s < stream_count; s++)
+                writers[s]->write(encode_table[data[i + s]].code, encode_table[data[i + s]].length);
+        for (int s = 0; i < size; i++, s++)
+            writers[s]->write(encode_table[data[i]].code, encode_table[data[i]].length);
+        long long group_size = 0;
+        for (int s = 0; s < stream_count; s++) {
+            writers[s]->flush();
+            unsigned int substream_size = substreams[s].size();
+            writer << substream_size;
+            group_size += substream_size;
+        }
+        for (int s = 0; s < stream_count; s++)
+            writer.writeBytes(substreams[s].data(), substreams[s].size());
+        extra_bytes += stream_count * sizeof(unsigned int);
+        output_size += stream_count * sizeof(unsigned int);
+        return group_size * byte_size;
     }
 
-    void Tree::encodeAndWriteCompressed(std::ifstream &in, std::ofstream &out) {
+    void Tree::writeStreamCount(BitWriter &writer) {
+        unsigned char streams_byte = stream_count;
+        writer << streams_byte;
+        extra_bytes += sizeof(streams_byte);
+    }
+
+    void Tree::readStreamCount(BitReader &reader) {
+        unsigned char streams_byte;
+        if (!(reader >> streams_byte) || streams_byte < 2 || streams_byte > max_streams
+            || (streams_byte & (streams_byte - 1)) != 0)
+            throw std::invalid_argument("Header data not found");
+        stream_count = streams_byte;
+        extra_bytes += sizeof(streams_byte);
+    }
+
+    void Tree::encodeAndWriteCompressed(std::istream &in, std::ostream &out, const ByteSpan *input) {
         long long total_bits = 0;
-        auto writer = BitWriter(out);
-        auto reader = BitReader(in);
-        writer << count;
-        for (auto cnt: entries)
-            writer << cnt;
+        BitWriter writer(out, write_buffer);
+        writer << format;
+        if (format == trained_format) {
+            writer << trained_table_id << count;
+            extra_bytes = sizeof(format) + sizeof(trained_table_id) + sizeof(count);
+        } else {
+            extra_bytes = sizeof(format) + writeTable(writer);
+        }
+        if (format == interleaved_format)
+            writeStreamCount(writer);
         output_size += extra_bytes;
-        unsigned char c;
-        while (reader >> c) {
-            for (bool bit: codes[c]) {
-                writer << bit;
-                total_bits++;
+        if (format == interleaved_format) {
+            std::vector<char> &buffer = io_buffer;
+            buffer.resize(input != nullptr ? 0 : interleaved_chunk_size);
+            for (long long done = 0; done < count; done += interleaved_chunk_size) {
+                long long size = std::min<long long>(interleaved_chunk_size, count - done);
+                const char *chunk = buffer.data();
+                if (input != nullptr)
+                    chunk = input->data + done;
+                else
+                    readInput(in, buffer.data(), size);
+                total_bits += encodeInterleaved((unsigned char *) chunk, size, writer);
             }
+        } else if (input != nullptr) {
+            selectPairCoding();
+            total_bits = encodeSymbols((unsigned char *) input->data, input->size, writer);
+        } else {
+            selectPairCoding();
+            std::vector<char> &buffer = io_buffer;
+            buffer.resize(io_buffer_size);
+            while (readInput(in, buffer.data(), io_buffer_size) > 0)
+                total_bits += encodeSymbols((unsigned char *) buffer.data(), in.gcount(), writer);
         }
         writer.flush();
         if (total_bits != 0)
             output_size += (total_bits - 1) / byte_size + 1;
     }
 
-    void Tree::loadEncodedTree(std::ifstream &in) {
+    // A block is stored as is when its table and codes would not be smaller than the raw bytes
+    void Tree::encodeBlock(const unsigned char *data, size_t size, BitWriter &writer) {
+        clear();
+        countEntries(data, size);
+        buildTree();
+        long long total_bits = 0;
+        for (int i = 0; i < max_chars; i++)
+            total_bits += entries[i] * lengths[i];
+        unsigned short symbols = max_chars - std::count(lengths, lengths + max_chars, 0);
+        long long table_bytes = sizeof(count) + sizeof(symbols) + 2 * symbols;
+        long long coded_bytes = (total_bits + byte_size - 1) / byte_size;
+        stream_count = streams;
+        // stream count, substream sizes and the padding of every substream
+        if (stream_count > 1)
+            coded_bytes += 1 + stream_count * (sizeof(unsigned int) + 1);
+        unsigned char type = table_bytes + coded_bytes < (long long) (sizeof(count) + size) ? huffman_block : stored_block;
+        if (type == huffman_block && stream_count > 1)
+            type = interleaved_block;
+        writer << type;
+        if (type == stored_block) {
+            writer << count;
+            writer.writeBytes((const char *) data, size);
+            extra_bytes = sizeof(type) + sizeof(count);
+            output_size = extra_bytes + size;
+            return;
+        }
+        extra_bytes = sizeof(type) + writeTable(writer);
+        if (type == interleaved_block) {
+            writeStreamCount(writer);
+            total_bits = encodeInterleaved(data, size, writer);
+        } else {
+            selectPairCoding();
+            encodeSymbols(data, size, writer);
+        }
+        output_size = extra_bytes + (total_bits + byte_size - 1) / byte_size;
+    }
+
+    // Takes up to one block per worker, codes them concurrently and writes the results in order.
+    // Blocks are read from the stream, or point straight into the mapped input.
+    // The block index is written as a placeholder and filled in once all frame sizes are known.
+    // Inputs that cannot seek do not tell their size and outputs that cannot seek cannot take the index
+    // afterwards, either is coded as a stream archive of the same blocks.
+    void Tree::encodeBlocks(std::istream &in, std::ostream &out, const ByteSpan *input) {
+        std::streamoff archive_start = out.tellp();
+        if ((input == nullptr && in.tellg() < 0) || archive_start < 0) {
+            format = stream_format;
+            encodeStream(in, out);
+            return;
+        }
+        if (input != nullptr) {
+            count = input->size;
+        } else {
+            in.seekg(0, std::ios::end);
+            count = in.tellg();
+            if (!in.seekg(0) || count < 0) throw std::invalid_argument("Input must be seekable");
+        }
+        block_count = (count + block_size - 1) / block_size;
+        block_index.assign(block_count, BlockIndexEntry());
+        BitWriter writer(out, write_buffer);
+        writer << format << count << block_count;
+        for (auto &entry: block_index)
+            writer << entry.offset << entry.size;
+        extra_bytes = sizeof(format) + sizeof(count) + sizeof(block_count) + block_count * sizeof(BlockIndexEntry);
+        output_size = extra_bytes;
+        input_size = count;
+
+        int workers = prepareWorkers();
+        for (long long first = 0; first < block_count; first += workers) {
+            size_t batch = std::min<long long>(workers, block_count - first);
+            for (size_t i = 0; i < batch; i++) {
+                BlockSlot &slot = block_slots[i];
+                slot.size = std::min<long long>(block_size, count - (first + i) * block_size);
+                if (input != nullptr) {
+                    slot.data = input->data + (first + i) * block_size;
+                } else {
+                    slot.input.resize(slot.size);
+                    readInput(in, slot.input.data(), slot.size);
+                    slot.data = slot.input.data();
+                }
+            }
+            parallelFor(batch, workers, [&](size_t i, int worker) {
+                BlockSlot &slot = block_slots[i];
+                slot.output.clear();
+                BitWriter block_writer(slot.output);
+                worker_trees[worker].max_code_length = max_code_length;
+                worker_trees[worker].streams = streams;
+                worker_trees[worker].encodeBlock((unsigned char *) slot.data, slot.size, block_writer);
+                block_writer.flush();
+                slot.header_bytes = worker_trees[worker].extra_bytes;
+            });
+            for (size_t i = 0; i < batch; i++) {
+                BlockSlot &slot = block_slots[i];
+                block_index[first + i] = BlockIndexEntry{output_size, slot.size};
+                writer.writeBytes(slot.output.data(), slot.output.size());
+                output_size += slot.output.size();
+                extra_bytes += slot.header_bytes;
+            }
+        }
+        writer.flush();
+        if (!out.seekp(archive_start + sizeof(format) + sizeof(count) + sizeof(block_count)))
+            throw std::invalid_argument("Output must be seekable");
+        for (auto &entry: block_index)
+            writer << entry.offset << entry.size;
+        writer.flush();
+        for (int worker = 0; worker < workers; worker++)
+            statistics.addPhases(worker_trees[worker].statistics);
+    }
+
+    // Worker trees and block slots for one batch, kept from earlier calls where there are enough.
+    // The statistics of the workers start over, they are added to the caller's at the end.
+    int Tree::prepareWorkers() {
+        int workers = workerThreads();
+        if ((int) worker_trees.size() < workers)
+            worker_trees.resize(workers);
+        if ((int) block_slots.size() < workers)
+            block_slots.resize(workers);
+        for (int worker = 0; worker < workers; worker++)
+            worker_trees[worker].statistics = Statistics();
+        return workers;
+    }
+
+    void Tree::loadEncodedTree(std::istream &in) {
         auto reader = BitReader(in);
-        if (!(reader >> count) || count < 0) throw std::invalid_argument("Header data not found");
-        for (long long &entry : entries) {
-            if (!(reader >> entry) || count < 0) throw std::invalid_argument("Header data not found");
+        if (!(reader >> format)) throw std::invalid_argument("Header data not found");
+        if (format >= 0) {
+            count = format;
+            format = legacy_format;
+            for (long long &entry : entries) {
+                if (!(reader >> entry)) throw std::invalid_argument("Header data not found");
+            }
+            extra_bytes = legacy_header_bytes;
+        } else if (format == canonical_format || format == interleaved_format) {
+            extra_bytes = sizeof(format) + readTable(reader);
+            if (format == interleaved_format)
+                readStreamCount(reader);
+        } else if (format == stream_format || format == adaptive_format) {
+            extra_bytes = sizeof(format);
+        } else if (format == context_format) {
+            if (!(reader >> count) || count < 0) throw std::invalid_argument("Header data not found");
+            extra_bytes = sizeof(format) + sizeof(count);
+        } else if (format == trained_format) {
+            unsigned long long table_id;
+            if (!(reader >> table_id >> count) || count < 0) throw std::invalid_argument("Header data not found");
+            loadTrainedTable();
+            if (table_id != trained_table_id) throw std::invalid_argument("Trained table does not match the archive");
+            extra_bytes = sizeof(format) + sizeof(table_id) + sizeof(count);
+        } else if (format == block_format) {
+            if (in.tellg() < 0) throw std::invalid_argument("Block archives need a seekable input");
+            if (!(reader >> count >> block_count) || count < 0 || block_count < 0)
+                throw std::invalid_argument("Header data not found");
+            loadBlockIndex(reader, in);
+            extra_bytes = sizeof(format) + sizeof(count) + sizeof(block_count) + block_count * sizeof(BlockIndexEntry);
+        } else {
+            throw std::invalid_argument("Header data not found");
+        }
+        // legacy archives keep reporting a short payload as missing bits, as they always have
+        if (format != legacy_format && format != block_format && countInHeader()) {
+            long long payload = payloadBytes(in);
+            if (payload >= 0 && !countFits(payload)) throw std::invalid_argument("Header data not found");
         }
         input_size += extra_bytes;
     }
 
-    void Tree::loadRawEntries(std::ifstream &in) {
-        auto reader = BitReader(in);
+    // Bytes after the header, or -1 for inputs that cannot seek and so do not tell
+    long long Tree::payloadBytes(std::istream &in) {
+        std::streampos header_end = in.tellg();
+        if (header_end < 0 || !in.seekg(0, std::ios::end)) {
+            in.clear();
+            return -1;
+        }
+        long long payload = in.tellg() - header_end;
+        in.seekg(header_end);
+        return payload;
+    }
+
+    // Every byte takes at least one bit, interleaved and block archives are given more room, so a count
+    // beyond that does not belong to the bytes that follow. Outputs are sized by the count, it is checked before.
+    bool Tree::countFits(long long payload) const {
+        return count <= payload * (format == interleaved_format || format == block_format ? 32 : byte_size);
+    }
+
+    // Reads one chunk per worker at a time, or all of a seekable input that is smaller than that
+    void Tree::loadRawEntries(std::istream &in) {
         std::fill(entries, entries + max_chars, 0);
-        unsigned char c;
-        while (reader >> c) {
-            entries[c]++;
-            count++;
-            input_size++;
+        size_t buffer_size = (size_t) workerThreads() * histogram_chunk_size;
+        std::streampos position = in.tellg();
+        if (position >= 0 && in.seekg(0, std::ios::end)) {
+            long long remaining = (long long) (in.tellg() - position);
+            in.seekg(position);
+            buffer_size = std::min<size_t>(buffer_size, std::max<long long>(remaining, 1));
+        }
+        in.clear();
+        read_buffer.resize(buffer_size);
+        while (readInput(in, read_buffer.data(), buffer_size) > 0)
+            loadRawEntries((unsigned char *) read_buffer.data(), in.gcount());
+    }
+
+    // Every worker counts its chunks into its own histogram, the histograms are added up at the end
+    void Tree::loadRawEntries(const unsigned char *data, size_t size) {
+        PhaseTimer timer(statistics.histogram);
+        int workers = workerThreads();
+        size_t chunks = (size + histogram_chunk_size - 1) / histogram_chunk_size;
+        histograms.resize(std::min<size_t>(workers, chunks));
+        for (auto &histogram: histograms)
+            histogram.fill(0);
+        parallelFor(chunks, workers, [&](size_t i, int worker) {
+            size_t begin = i * histogram_chunk_size;
+            countBytes(data + begin, std::min<size_t>(histogram_chunk_size, size - begin), histograms[worker].data());
+        });
+        for (auto &histogram: histograms)
+            for (int i = 0; i < max_chars; i++)
+                entries[i] += histogram[i];
+        count += size;
+        input_size += size;
+    }
+
+    void Tree::countEntries(const unsigned char *data, size_t size) {
+        PhaseTimer timer(statistics.histogram);
+        countBytes(data, size, entries);
+        count += size;
+        input_size += size;
+    }
+
+    // Consecutive bytes go to four interleaved sub-histograms, so a run of equal bytes
+    // does not make every increment wait for the previous one to be stored
+    void Tree::countBytes(const unsigned char *data, size_t size, long long *histogram) {
+        static const size_t max_piece = 1u << 30;
+        unsigned int counts[4][max_chars];
+        while (size > 0) {
+            std::fill(&counts[0][0], &counts[0][0] + 4 * max_chars, 0);
+            size_t piece = std::min(size, max_piece), i = 0;
+            for (; i + 4 <= piece; i += 4) {
+                counts[0][data[i]]++;
+                counts[1][data[i + 1]]++;
+                counts[2][data[i + 2]]++;
+                counts[3][data[i + 3]]++;
+            }
+            for (; i < piece; i++)
+                counts[0][data[i]]++;
+            for (int c = 0; c < max_chars; c++)
+                histogram[c] += (long long) counts[0][c] + counts[1][c] + counts[2][c] + counts[3][c];
+            data += piece;
+            size -= piece;
+        }
+    }
+
+    void Tree::buildDecodeTable() {
+        PhaseTimer timer(statistics.tree);
+        decode_table.assign(1 << decode_table_bits, DecodeEntry());
+        if (root != no_node)
+            fillDecodeTable(root, 0, 0);
+    }
+
+    void Tree::fillDecodeTable(short v, int depth, unsigned int prefix) {
+        int free_bits = decode_table_bits - depth;
+        if (v == no_node || tree[v].left_child == no_node) {
+            DecodeEntry entry;
+            entry.length = depth;
+            if (v == no_node)
+                entry.invalid = true;
+            else
+                entry.symbol = tree[v].symbol;
+            std::fill(decode_table.begin() + (prefix << free_bits), decode_table.begin() + ((prefix + 1) << free_bits), entry);
+            return;
+        }
+        if (free_bits == 0) {
+            decode_table[prefix].length = depth;
+            decode_table[prefix].subtree = v;
+            return;
+        }
+        fillDecodeTable(tree[v].left_child, depth + 1, prefix << 1);
+        fillDecodeTable(tree[v].right_child, depth + 1, (prefix << 1) | 1);
+    }
+
+    // Lengths alone do not tell how often every code occurs, but a code of length l stands for a
+    // probability near 2^-l, which gives the average the table is built for
+    void Tree::selectMultiDecoding() {
+        double average = 0;
+        for (int i = 0; i < max_chars; i++)
+            if (lengths[i] != 0)
+                average += std::ldexp(lengths[i], -lengths[i]);
+        multi_decoding = count >= min_multi_decoding_bytes && average <= max_multi_code_length;
+        if (multi_decoding)
+            buildMultiDecodeTable();
+    }
+
+    // Every entry takes the codes of the single table one after another while they are complete
+    // within its bits, so an entry with no symbols is one the single table has to resolve
+    void Tree::buildMultiDecodeTable() {
+        PhaseTimer timer(statistics.tree);
+        multi_decode_table.resize(1 << decode_table_bits);
+        const unsigned int mask = (1 << decode_table_bits) - 1;
+        for (unsigned int prefix = 0; prefix <= mask; prefix++) {
+            MultiDecodeEntry &entry = multi_decode_table[prefix];
+            entry = MultiDecodeEntry();
+            while (entry.count < max_multi_symbols) {
+                const DecodeEntry &next = decode_table[(prefix << entry.length) & mask];
+                if (next.invalid || next.subtree != no_node || next.length == 0
+                    || entry.length + next.length > decode_table_bits)
+                    break;
+                entry.symbols[entry.count++] = next.symbol;
+                entry.length += next.length;
+            }
         }
     }
 
-    void Tree::decodeAndWriteText(std::ifstream &in, std::ofstream &out) {
+    long long Tree::decodeSymbols(BitReader &reader, unsigned char *out, long long size) {
+        if (multi_decoding)
+            return decodeMultiSymbols(reader, out, size);
+        PhaseTimer timer(statistics.coding);
         long long total_bits = 0;
-        auto reader = BitReader(in);
-        bool bit;
-        Node *v = root;
-        unsigned char c;
-        for (long long i = 0; i < count; i++) {
-            while (v != nullptr && v->left_child != nullptr) {
-                if (!(reader >> bit)) throw std::invalid_argument("Unable to read expected bits");
-                total_bits++;
-                if (!bit)
-                    v = v->left_child;
+        for (long long i = 0; i < size; i++)
+            out[i] = decodeSymbol(reader, total_bits);
+        return total_bits;
+    }
+
+    // Writes all max_multi_symbols symbols of an entry and moves on by the ones it holds, so the last
+    // few symbols are decoded one at a time
+    long long Tree::decodeMultiSymbols(BitReader &reader, unsigned char *out, long long size) {
+        PhaseTimer timer(statistics.coding);
+        const MultiDecodeEntry *table = multi_decode_table.data();
+        long long total_bits = 0, i = 0;
+        while (i + max_multi_symbols <= size) {
+            reader.refill();
+            const MultiDecodeEntry &entry = table[reader.peek(decode_table_bits)];
+            if (entry.count == 0 || entry.length > reader.available()) {
+                out[i++] = decodeSymbol(reader, total_bits);
+                continue;
+            }
+            reader.consume(entry.length);
+            total_bits += entry.length;
+            std::copy(entry.symbols, entry.symbols + max_multi_symbols, out + i);
+            i += entry.count;
+        }
+        for (; i < size; i++)
+            out[i] = decodeSymbol(reader, total_bits);
+        return total_bits;
+    }
+
+    // Reads the substream sizes and all substreams of a group, then decodes one symbol from every
+    // substream per round. The substreams do not depend on each other, so their lookups overlap.
+    long long Tree::decodeInterleaved(BitReader &reader, unsigned char *out, long long size) {
+        PhaseTimer timer(statistics.coding);
+        unsigned int sizes[max_streams];
+        long long group_size = 0;
+        for (int s = 0; s < stream_count; s++) {
+            if (!(reader >> sizes[s])) throw std::invalid_argument("Header data not found");
+            group_size += sizes[s];
+        }
+        if (group_size > max_code_length_limit * size / byte_size + stream_count)
+            throw std::invalid_argument("Header data not found");
+        std::vector<char> &group = substreams[0];
+        group.resize(group_size);
+        if (!(reader.readBytes(group.data(), group_size))) throw std::invalid_argument("Unable to read expected bits");
+        extra_bytes += stream_count * sizeof(unsigned int);
+        input_size += stream_count * sizeof(unsigned int);
+
+        std::vector<BitReader> &readers = substream_readers;
+        readers.clear();
+        const char *data = group.data();
+        for (int s = 0; s < stream_count; s++) {
+            readers.emplace_back(data, sizes[s]);
+            data += sizes[s];
+        }
+        long long total_bits = 0, i = 0;
+        while (i + stream_count <= size) {
+            if (stream_count == 2)
+                i += decodeRounds<2>(readers.data(), out + i, size - i);
+            else if (stream_count == 4)
+                i += decodeRounds<4>(readers.data(), out + i, size - i);
+            else
+                i += decodeRounds<8>(readers.data(), out + i, size - i);
+            if (i + stream_count > size) break;
+            // a code longer than the table, an invalid one or the end of a substream
+            for (int s = 0; s < stream_count; s++)
+                out[i + s] = decodeSymbol(readers[s], total_bits);
+            i += stream_count;
+        }
+        for (int s = 0; i < size; i++, s++)
+            out[i] = decodeSymbol(readers[s], total_bits);
+        return (long long) group_size * byte_size;
+    }
+
+    // Decodes one symbol per substream per round for as long as every substream's next code is
+    // complete in the table. Returns the number of symbols written, a multiple of streams.
+    // A full container holds the codes of several rounds, so the substreams are refilled once for
+    // all of them; near the end of a substream every round refills and checks the bits at hand.
+    template<int streams>
+    long long Tree::decodeRounds(BitReader *readers, unsigned char *out, long long size) {
+        const DecodeEntry *table = decode_table.data();
+        const int rounds = BitReader::max_peek_bits / decode_table_bits;
+        long long i = 0;
+        while (i + streams * rounds <= size) {
+            // the bits of the rounds are taken into locals, which the stores to out cannot alias
+            unsigned long long windows[streams];
+            int used[streams];
+            bool full = true;
+            for (int s = 0; s < streams; s++) {
+                readers[s].refill();
+                full &= readers[s].available() >= rounds * decode_table_bits;
+                windows[s] = readers[s].peek(BitReader::max_peek_bits) << (64 - BitReader::max_peek_bits);
+                used[s] = 0;
+            }
+            if (!full) break;
+            unsigned char symbols[rounds * streams];
+            int decoded = 0;
+            for (int round = 0; round < rounds; round++) {
+                int lengths[streams];
+                int s = 0;
+                for (; s < streams; s++) {
+                    DecodeEntry hit = table[windows[s] >> (64 - decode_table_bits)];
+                    if (hit.subtree != no_node || hit.invalid) break;
+                    lengths[s] = hit.length;
+                    windows[s] <<= hit.length;
+                    used[s] += hit.length;
+                    symbols[decoded + s] = hit.symbol;
+                }
+                if (s < streams) {
+                    // the round is left to the caller as a whole, the substreams before s give their code back
+                    for (int t = 0; t < s; t++)
+                        used[t] -= lengths[t];
+                    break;
+                }
+                decoded += streams;
+            }
+            for (int s = 0; s < streams; s++)
+                readers[s].consume(used[s]);
+            std::copy(symbols, symbols + decoded, out + i);
+            i += decoded;
+            if (decoded < rounds * streams)
+                return i;
+        }
+        for (; i + streams <= size; i += streams) {
+            const DecodeEntry *hits[streams];
+            bool all_hit = true;
+            for (int s = 0; s < streams; s++) {
+                readers[s].refill();
+                hits[s] = &table[readers[s].peek(decode_table_bits)];
+                all_hit &= (hits[s]->subtree == no_node) & !hits[s]->invalid & (hits[s]->length <= readers[s].available());
+            }
+            if (!all_hit) break;
+            unsigned char symbols[streams];
+            for (int s = 0; s < streams; s++) {
+                readers[s].consume(hits[s]->length);
+                symbols[s] = hits[s]->symbol;
+            }
+            std::copy(symbols, symbols + streams, out + i);
+        }
+        return i;
+    }
+
+    // With a mapped input the codes are read from memory right after the header,
+    // with a mapped output all symbols are decoded straight into it
+    void Tree::decodeAndWriteText(std::istream &in, std::ostream &out, const ByteSpan *input, char *output) {
+        if (count > 0 && root == no_node)
+            throw std::invalid_argument("Invalid bit sequence");
+        buildDecodeTable();
+        long long total_bits = 0;
+        long long header_end = in.tellg();
+        auto reader = input != nullptr ? BitReader(input->data + header_end, input->size - header_end)
+                                       : BitReader(in, read_block);
+        if (format == interleaved_format) {
+            std::vector<char> &buffer = io_buffer;
+            buffer.resize(output != nullptr ? 0 : interleaved_chunk_size);
+            for (long long done = 0; done < count && done < range_end; done += interleaved_chunk_size) {
+                long long size = std::min<long long>(interleaved_chunk_size, count - done);
+                char *chunk = output != nullptr ? output + done : buffer.data();
+                total_bits += decodeInterleaved(reader, (unsigned char *) chunk, size);
+                if (output == nullptr)
+                    writeRange(out, chunk, done, size);
                 else
-                    v = v->right_child;
+                    output_size += size;
+            }
+        } else if (output != nullptr) {
+            selectMultiDecoding();
+            total_bits = decodeSymbols(reader, (unsigned char *) output, count);
+            output_size = count;
+        } else {
+            selectMultiDecoding();
+            std::vector<char> &buffer = io_buffer;
+            buffer.resize(io_buffer_size);
+            for (long long done = 0; done < count && done < range_end; done += io_buffer_size) {
+                long long size = std::min<long long>(io_buffer_size, count - done);
+                total_bits += decodeSymbols(reader, (unsigned char *) buffer.data(), size);
+                writeRange(out, buffer.data(), done, size);
             }
-            if (v == nullptr)
-                throw std::invalid_argument("Invalid bit sequence");
-            if (v->chars.size() != 1) throw std::logic_error("Something went wrong");
-            c = v->chars.front();
-            out << c;
-            v = root;
-            output_size++;
         }
         if (total_bits != 0)
             input_size += (total_bits - 1) / byte_size + 1;
     }
 
+    // Decodes a frame that must hold exactly size bytes into out
+    void Tree::decodeBlock(BitReader &reader, char *out, long long size) {
+        clear();
+        unsigned char type;
+        if (!(reader >> type)) throw std::invalid_argument("Header data not found");
+        if (type == stored_block) {
+            if (!(reader >> count)) throw std::invalid_argument("Header data not found");
+            if (count != size) throw std::invalid_argument("Block sizes do not match the header");
+            if (!(reader.readBytes(out, count))) throw std::invalid_argument("Unable to read expected bits");
+            extra_bytes = sizeof(type) + sizeof(count);
+            input_size = extra_bytes + count;
+        } else if (type == huffman_block || type == interleaved_block) {
+            extra_bytes = sizeof(type) + readTable(reader);
+            if (type == interleaved_block)
+                readStreamCount(reader);
+            if (count != size) throw std::invalid_argument("Block sizes do not match the header");
+            buildTree();
+            if (count > 0 && root == no_node)
+                throw std::invalid_argument("Invalid bit sequence");
+            buildDecodeTable();
+            if (type == huffman_block)
+                selectMultiDecoding();
+            long long total_bits = type == interleaved_block ? decodeInterleaved(reader, (unsigned char *) out, count)
+                                                             : decodeSymbols(reader, (unsigned char *) out, count);
+            input_size = extra_bytes + (total_bits + byte_size - 1) / byte_size;
+        } else {
+            throw std::invalid_argument("Header data not found");
+        }
+        output_size = count;
+    }
+
+    // Frames must follow each other in the file and their sizes must add up to the total count
+    void Tree::loadBlockIndex(BitReader &reader, std::istream &in) {
+        std::streampos header_end = in.tellg();
+        in.seekg(0, std::ios::end);
+        long long file_size = in.tellg();
+        in.seekg(header_end);
+        if (block_count > file_size / (long long) sizeof(BlockIndexEntry))
+            throw std::invalid_argument("Header data not found");
+        block_index.resize(block_count);
+        long long offset = sizeof(format) + sizeof(count) + sizeof(block_count) + block_count * sizeof(BlockIndexEntry);
+        long long total = 0;
+        for (auto &entry: block_index) {
+            if (!(reader >> entry.offset >> entry.size)) throw std::invalid_argument("Header data not found");
+            if (entry.offset < offset || entry.size < 0 || entry.size > max_block_size)
+                throw std::invalid_argument("Header data not found");
+            offset = entry.offset;
+            total += entry.size;
+        }
+        if (offset > file_size || total != count)
+            throw std::invalid_argument("Block sizes do not match the header");
+        // the frames are held to the same bound as whole archives, blocks can be interleaved
+        for (size_t i = 0; i < block_index.size(); i++) {
+            long long end = i + 1 < block_index.size() ? block_index[i + 1].offset : file_size;
+            if (block_index[i].size > (end - block_index[i].offset) * 32)
+                throw std::invalid_argument("Header data not found");
+        }
+    }
+
+    // Loads the frames of up to one block per worker and decodes them concurrently, every block
+    // into its own region of the output. Mapped files are used in place instead of buffers.
+    // Only the blocks holding the requested range are read, found by adding up block sizes.
+    void Tree::decodeBlocks(std::istream &in, std::ostream &out, const ByteSpan *input, char *output) {
+        in.seekg(0, std::ios::end);
+        long long file_size = in.tellg();
+        long long first_block = 0, position = 0;
+        while (first_block < block_count && position + block_index[first_block].size <= range_offset)
+            position += block_index[first_block++].size;
+        long long end_block = first_block;
+        for (long long end = position; end_block < block_count && end < range_end; end_block++)
+            end += block_index[end_block].size;
+
+        int workers = prepareWorkers();
+        for (long long first = first_block; first < end_block; first += workers) {
+            size_t batch = std::min<long long>(workers, end_block - first);
+            for (size_t i = 0; i < batch; i++) {
+                const BlockIndexEntry &entry = block_index[first + i];
+                BlockSlot &slot = block_slots[i];
+                long long end = first + i + 1 < (size_t) block_count ? block_index[first + i + 1].offset : file_size;
+                slot.size = end - entry.offset;
+                if (input != nullptr) {
+                    slot.data = input->data + entry.offset;
+                } else {
+                    slot.input.resize(slot.size);
+                    in.seekg(entry.offset);
+                    readInput(in, slot.input.data(), slot.size);
+                    slot.data = slot.input.data();
+                }
+                if (output != nullptr) {
+                    slot.block = output + position;
+                } else {
+                    slot.output.resize(entry.size);
+                    slot.block = slot.output.data();
+                }
+                slot.position = position;
+                position += entry.size;
+            }
+            parallelFor(batch, workers, [&](size_t i, int worker) {
+                BlockSlot &slot = block_slots[i];
+                BitReader reader(slot.data, slot.size);
+                worker_trees[worker].decodeBlock(reader, slot.block, block_index[first + i].size);
+                slot.input_bytes = worker_trees[worker].input_size;
+                slot.header_bytes = worker_trees[worker].extra_bytes;
+            });
+            for (size_t i = 0; i < batch; i++) {
+                BlockSlot &slot = block_slots[i];
+                if (output == nullptr)
+                    writeRange(out, slot.block, slot.position, block_index[first + i].size);
+                else
+                    output_size += block_index[first + i].size;
+                input_size += slot.input_bytes;
+                extra_bytes += slot.header_bytes;
+            }
+        }
+        for (int worker = 0; worker < workers; worker++)
+            statistics.addPhases(worker_trees[worker].statistics);
+    }
+
+    // Reads up to one block per worker at a time, codes them concurrently and writes every frame after
+    // its decompressed and compressed size. An empty frame ends the archive, so the input is read once
+    // and only one batch of blocks is kept in memory.
+    void Tree::encodeStream(std::istream &in, std::ostream &out) {
+        long long stream_block_size = block_size != 0 ? block_size : default_stream_block_size;
+        BitWriter writer(out, write_buffer);
+        writer << format;
+        extra_bytes = sizeof(format);
+        output_size = extra_bytes;
+
+        int workers = prepareWorkers();
+        for (bool finished = false; !finished;) {
+            int batch = 0;
+            for (; batch < workers; batch++) {
+                std::vector<char> &block = block_slots[batch].input;
+                block.resize(stream_block_size);
+                readInput(in, block.data(), stream_block_size);
+                block.resize(in.gcount());
+                if (block.empty()) {
+                    finished = true;
+                    break;
+                }
+            }
+            parallelFor(batch, workers, [&](size_t i, int worker) {
+                BlockSlot &slot = block_slots[i];
+                slot.output.clear();
+                BitWriter block_writer(slot.output);
+                worker_trees[worker].max_code_length = max_code_length;
+                worker_trees[worker].streams = streams;
+                worker_trees[worker].encodeBlock((unsigned char *) slot.input.data(), slot.input.size(), block_writer);
+                block_writer.flush();
+                slot.header_bytes = worker_trees[worker].extra_bytes;
+            });
+            for (int i = 0; i < batch; i++) {
+                BlockSlot &slot = block_slots[i];
+                long long size = slot.input.size(), frame_size = slot.output.size();
+                writer << size << frame_size;
+                writer.writeBytes(slot.output.data(), frame_size);
+                count += size;
+                output_size += sizeof(size) + sizeof(frame_size) + frame_size;
+                extra_bytes += sizeof(size) + sizeof(frame_size) + slot.header_bytes;
+            }
+        }
+        long long end = 0;
+        writer << end << end;
+        output_size += 2 * sizeof(end);
+        extra_bytes += 2 * sizeof(end);
+        input_size = count;
+        writer.flush();
+        for (int worker = 0; worker < workers; worker++)
+            statistics.addPhases(worker_trees[worker].statistics);
+    }
+
+    // Reads the frames of up to one block per worker, decodes them concurrently and writes them
+    // in order until the empty frame that ends the archive
+    void Tree::decodeStream(std::istream &in, std::ostream &out) {
+        BitReader reader(in, read_block);
+        int workers = prepareWorkers();
+        long long position = 0;
+        for (bool finished = false; !finished;) {
+            int batch = 0;
+            while (batch < workers) {
+                long long size, frame_size;
+                if (!(reader >> size >> frame_size) || size < 0 || size > max_block_size || frame_size < 0
+                    || frame_size > (long long) (sizeof(stored_block) + sizeof(count)) + size)
+                    throw std::invalid_argument("Header data not found");
+                input_size += sizeof(size) + sizeof(frame_size);
+                extra_bytes += sizeof(size) + sizeof(frame_size);
+                if (size == 0 || position >= range_end) {
+                    finished = true;
+                    break;
+                }
+                BlockSlot &slot = block_slots[batch];
+                slot.input.resize(frame_size);
+                if (!(reader.readBytes(slot.input.data(), frame_size)))
+                    throw std::invalid_argument("Unable to read expected bits");
+                // frames before the requested range are read past without decoding them
+                if (position + size > range_offset) {
+                    slot.output.resize(size);
+                    slot.position = position;
+                    batch++;
+                }
+                position += size;
+            }
+            parallelFor(batch, workers, [&](size_t i, int worker) {
+                BlockSlot &slot = block_slots[i];
+                BitReader frame_reader(slot.input.data(), slot.input.size());
+                worker_trees[worker].decodeBlock(frame_reader, slot.output.data(), slot.output.size());
+                slot.input_bytes = worker_trees[worker].input_size;
+                slot.header_bytes = worker_trees[worker].extra_bytes;
+            });
+            for (int i = 0; i < batch; i++) {
+                BlockSlot &slot = block_slots[i];
+                writeRange(out, slot.output.data(), slot.position, slot.output.size());
+                input_size += slot.input_bytes;
+                extra_bytes += slot.header_bytes;
+            }
+        }
+        count = position;
+        for (int worker = 0; worker < workers; worker++)
+            statistics.addPhases(worker_trees[worker].statistics);
+    }
+
+    ContextModel &Tree::contextModel() {
+        if (context_models.empty())
+            context_models.emplace_back();
+        return context_models.front();
+    }
+
+    // Counts the input by context, then codes it with the tables of the context groups
+    void Tree::encodeContext(std::istream &in, std::ostream &out, const ByteSpan *input) {
+        if (input == nullptr && in.tellg() < 0) throw std::invalid_argument("Context mode needs a seekable input");
+        ContextModel &model = contextModel();
+        model.reset();
+        std::vector<char> &buffer = io_buffer;
+        buffer.resize(input != nullptr ? 0 : io_buffer_size);
+        auto countContexts = [&](const char *data, size_t size) {
+            PhaseTimer timer(statistics.histogram);
+            model.count((const unsigned char *) data, size);
+            count += size;
+        };
+        if (input != nullptr) {
+            countContexts(input->data, input->size);
+        } else {
+            while (readInput(in, buffer.data(), io_buffer_size) > 0)
+                countContexts(buffer.data(), in.gcount());
+            in.clear();
+            if (!in.seekg(0)) throw std::invalid_argument("Context mode needs a seekable input");
+        }
+        {
+            PhaseTimer timer(statistics.tree);
+            model.build(max_code_length);
+        }
+        BitWriter writer(out, write_buffer);
+        writer << format << count;
+        extra_bytes = sizeof(format) + sizeof(count) + model.writeHeader(writer);
+        long long total_bits = 0;
+        auto encode = [&](const char *data, size_t size) {
+            PhaseTimer timer(statistics.coding);
+            total_bits += model.encode((const unsigned char *) data, size, writer);
+        };
+        if (input != nullptr) {
+            encode(input->data, input->size);
+        } else {
+            while (readInput(in, buffer.data(), io_buffer_size) > 0)
+                encode(buffer.data(), in.gcount());
+        }
+        writer.flush();
+        input_size = count;
+        output_size = extra_bytes + (total_bits + byte_size - 1) / byte_size;
+    }
+
+    void Tree::decodeContext(std::istream &in, std::ostream &out, const ByteSpan *input, char *output) {
+        long long header_end = in.tellg();
+        auto reader = input != nullptr ? BitReader(input->data + header_end, input->size - header_end)
+                                       : BitReader(in, read_block);
+        ContextModel &model = contextModel();
+        long long header_bytes;
+        {
+            PhaseTimer timer(statistics.tree);
+            header_bytes = model.readHeader(reader, count);
+        }
+        extra_bytes += header_bytes;
+        input_size += header_bytes;
+        long long total_bits = 0;
+        auto decode = [&](char *data, long long size) {
+            PhaseTimer timer(statistics.coding);
+            total_bits += model.decode(reader, (unsigned char *) data, size);
+        };
+        if (output != nullptr) {
+            decode(output, count);
+            output_size = count;
+        } else {
+            std::vector<char> &buffer = io_buffer;
+            buffer.resize(io_buffer_size);
+            for (long long done = 0; done < count && done < range_end; done += io_buffer_size) {
+                long long size = std::min<long long>(io_buffer_size, count - done);
+                decode(buffer.data(), size);
+                writeRange(out, buffer.data(), done, size);
+            }
+        }
+        input_size += (total_bits + byte_size - 1) / byte_size;
+    }
+
+    // Every byte value counts once more than it occurs in the samples, so that it gets a code
+    void Tree::trainTable(const std::vector<std::string> &sample_file_names, std::string &table_file_name,
+                          bool print_stat) {
+        clear();
+        checkSettings();
+        std::vector<char> buffer(io_buffer_size);
+        for (auto &name: sample_file_names) {
+            std::ifstream file;
+            if (name != standard_stream) file.open(name);
+            std::istream &in = name == standard_stream ? std::cin : file;
+            if (!in) throw std::invalid_argument("Unable to open input file");
+            while (readInput(in, buffer.data(), io_buffer_size) > 0)
+                loadRawEntries((const unsigned char *) buffer.data(), in.gcount());
+        }
+        for (long long &entry: entries)
+            entry++;
+        buildTree();
+        std::ofstream out(table_file_name);
+        if (!out) throw std::invalid_argument("Unable to open output file");
+        auto writer = BitWriter(out);
+        long long tag = table_file_format;
+        unsigned long long table_id = tableId(lengths);
+        writer << tag << table_id;
+        output_size = sizeof(tag) + sizeof(table_id) + writeTable(writer);
+        writer.flush();
+        if (print_stat)
+            std::cout << input_size << std::endl << output_size << std::endl;
+        clear();
+    }
+
+    // Reads table_file unless it is the one loaded last and makes its lengths and codes the current ones.
+    // The codes are enough to encode, decoding builds the tree from the lengths.
+    void Tree::loadTrainedTable() {
+        if (table_file.empty()) throw std::invalid_argument("Archive needs a trained table");
+        if (table_file != loaded_table_file) {
+            std::ifstream in(table_file);
+            if (!in) throw std::invalid_argument("Unable to open table file");
+            auto reader = BitReader(in);
+            long long tag;
+            unsigned long long table_id;
+            if (!(reader >> tag >> table_id) || tag != table_file_format)
+                throw std::invalid_argument("Invalid trained table");
+            Tree table;
+            table.readTable(reader);
+            table.buildTree();
+            for (unsigned char length: table.lengths)
+                if (length == 0 || length > max_code_length_limit) throw std::invalid_argument("Invalid trained table");
+            if (table_id != tableId(table.lengths)) throw std::invalid_argument("Invalid trained table");
+            std::copy(table.lengths, table.lengths + max_chars, trained_lengths);
+            std::copy(table.encode_table, table.encode_table + max_chars, trained_table);
+            trained_table_id = table_id;
+            loaded_table_file = table_file;
+        }
+        std::copy(trained_lengths, trained_lengths + max_chars, lengths);
+        std::copy(trained_table, trained_table + max_chars, encode_table);
+        lengths_loaded = true;
+    }
+
+    // FNV-1a of the code lengths
+    unsigned long long Tree::tableId(const unsigned char *lengths) {
+        unsigned long long hash = 14695981039346656037ULL;
+        for (int i = 0; i < max_chars; i++)
+            hash = (hash ^ lengths[i]) * 1099511628211ULL;
+        return hash;
+    }
+
+    // Codes every byte with the tree of the bytes before it, so that the input is read once and the
+    // archive has no table. An end marker takes the place of the count.
+    void Tree::encodeAdaptive(std::istream &in, std::ostream &out, const ByteSpan *input) {
+        BitWriter writer(out, write_buffer);
+        writer << format;
+        extra_bytes = sizeof(format);
+        AdaptiveModel model;
+        long long total_bits = 0;
+        auto encode = [&](const unsigned char *data, size_t size) {
+            PhaseTimer timer(statistics.coding);
+            for (size_t i = 0; i < size; i++)
+                total_bits += model.encode(data[i], writer);
+            count += size;
+        };
+        if (input != nullptr) {
+            encode((const unsigned char *) input->data, input->size);
+        } else {
+            std::vector<char> &buffer = io_buffer;
+            buffer.resize(io_buffer_size);
+            while (readInput(in, buffer.data(), io_buffer_size) > 0)
+                encode((const unsigned char *) buffer.data(), in.gcount());
+        }
+        total_bits += model.encodeEnd(writer);
+        writer.flush();
+        input_size = count;
+        output_size = extra_bytes + (total_bits + byte_size - 1) / byte_size;
+    }
+
+    void Tree::decodeAdaptive(std::istream &in, std::ostream &out, const ByteSpan *input) {
+        long long header_end = in.tellg();
+        auto reader = input != nullptr ? BitReader(input->data + header_end, input->size - header_end)
+                                       : BitReader(in, read_block);
+        AdaptiveModel model;
+        long long total_bits = 0;
+        // the end marker tells the size, so bytes are decoded here first even into a buffer of the caller
+        std::vector<char> &buffer = io_buffer;
+        buffer.resize(io_buffer_size);
+        bool ended = false;
+        while (!ended && count < range_end) {
+            long long size = 0;
+            {
+                PhaseTimer timer(statistics.coding);
+                while (size < io_buffer_size && !(ended = !model.decode(reader, (unsigned char &) buffer[size], total_bits)))
+                    size++;
+            }
+            writeRange(out, buffer.data(), count, size);
+            count += size;
+        }
+        input_size += (total_bits + byte_size - 1) / byte_size;
+    }
+
+    // Writes the part of the decompressed bytes [position, position + size) that is in the requested range
+    void Tree::writeRange(std::ostream &out, const char *data, long long position, long long size) {
+        long long begin = std::max(position, range_offset), end = std::min(position + size, range_end);
+        if (begin >= end) return;
+        PhaseTimer timer(statistics.io);
+        out.write(data + begin - position, end - begin);
+        output_size += end - begin;
+    }
+
+    Tree::MeasuredCall::MeasuredCall(Tree &tree, bool encoded) : tree(tree), encoded(encoded),
+                                                                 timer(tree.statistics.total, true) {
+        tree.statistics = Statistics();
+    }
+
+    Tree::MeasuredCall::~MeasuredCall() {
+        tree.statistics.finish(tree.input_size, tree.output_size, tree.extra_bytes,
+                               encoded ? tree.input_size : tree.output_size, encoded);
+    }
+
+    std::streamsize Tree::readInput(std::istream &in, char *buffer, std::streamsize size) {
+        PhaseTimer timer(statistics.io);
+        in.read(buffer, size);
+        return in.gcount();
+    }
+
+    bool Tree::countInHeader() const {
+        return format != stream_format && format != adaptive_format;
+    }
+
+    bool Tree::wholeRange() const {
+        return range_offset == 0 && range_length < 0;
+    }
+
+    int Tree::workerThreads() const {
+        return threads > 0 ? threads : hardwareThreads();
+    }
+
+    // The file streams buffer into storage of the tree instead of allocating their own on open
+    void Tree::useFileBuffers(std::ifstream &in, std::ofstream &out) {
+        input_file_buffer.resize(io_buffer_size);
+        output_file_buffer.resize(io_buffer_size);
+        in.rdbuf()->pubsetbuf(input_file_buffer.data(), input_file_buffer.size());
+        out.rdbuf()->pubsetbuf(output_file_buffer.data(), output_file_buffer.size());
+    }
+
     void
     Tree::encodeFile(std::string &input_file_name, std::string &output_file_name, bool print_stat, bool clear_on_exit) {
-        std::ifstream in = std::ifstream(input_file_name);
-        std::ofstream out = std::ofstream(output_file_name);
+        bool read_stdin = input_file_name == standard_stream, write_stdout = output_file_name == standard_stream;
+        std::ifstream in;
+        std::ofstream out;
+        useFileBuffers(in, out);
+        if (!read_stdin) in.open(input_file_name);
+        if (!write_stdout) out.open(output_file_name);
         try {
             if (!in) throw std::invalid_argument("Unable to open input file");
             if (!out) throw std::invalid_argument("Unable to open output file");
-            loadRawEntries(in);
-            buildTree();
-            in.clear();
-            in.seekg(0);
-            encodeAndWriteCompressed(in, out);
-            in.close();
-            out.close();
-            if (print_stat)
-                std::cout << input_size << std::endl << output_size - extra_bytes << std::endl << extra_bytes
-                          << std::endl;
+            {
+                MeasuredCall call(*this, true);
+                clear();
+                checkSettings();
+                MappedFile input;
+                bool mapped = memory_map && !read_stdin && input.mapInput(input_file_name);
+                ByteSpan span{input.data(), input.size()};
+                if (read_stdin && context) throw std::invalid_argument("Context mode needs a seekable input");
+                if ((read_stdin || write_stdout) && !adaptive && !context && table_file.empty()) {
+                    format = stream_format;
+                    encodeStream(read_stdin ? std::cin : in, write_stdout ? std::cout : out);
+                } else {
+                    encodeArchive(read_stdin ? std::cin : in, write_stdout ? std::cout : out, mapped ? &span : nullptr);
+                }
+                in.close();
+                out.close();
+                if (write_stdout) std::cout.flush();
+            }
+            if (print_stat && statistics_format != StatisticsFormat::sizes)
+                statistics.write(write_stdout ? std::cerr : std::cout, statistics_format);
+            else if (print_stat)
+                (write_stdout ? std::cerr : std::cout) << input_size << std::endl << output_size - extra_bytes
+                                                       << std::endl << extra_bytes << std::endl;
             if (clear_on_exit)
                 clear();
         }
@@ -153,71 +1426,391 @@ namespace Huffman {
 
     void
     Tree::decodeFile(std::string &input_file_name, std::string &output_file_name, bool print_stat, bool clear_on_exit) {
-        std::ifstream in = std::ifstream(input_file_name);
-        std::ofstream out = std::ofstream(output_file_name);
+        bool read_stdin = input_file_name == standard_stream, write_stdout = output_file_name == standard_stream;
+        std::ifstream in;
+        std::ofstream out;
+        useFileBuffers(in, out);
+        if (!read_stdin) in.open(input_file_name);
+        if (!write_stdout) out.open(output_file_name);
+        std::istream &source = read_stdin ? std::cin : in;
+        std::ostream &destination = write_stdout ? std::cout : out;
+        // what a failed decoding wrote is removed, but not a file that could not even be opened
+        bool created = !write_stdout && out.is_open();
         try {
             if (!in) throw std::invalid_argument("Unable to open input file");
             if (!out) throw std::invalid_argument("Unable to open output file");
-            loadEncodedTree(in);
-            buildTree();
-            decodeAndWriteText(in, out);
-            in.close();
-            out.close();
-            if (print_stat)
-                std::cout << input_size - extra_bytes << std::endl << output_size << std::endl << extra_bytes << std::endl;
+            {
+                MeasuredCall call(*this, false);
+                clear();
+                checkRange();
+                loadEncodedTree(source);
+                MappedFile input, output;
+                bool input_mapped = memory_map && !read_stdin && input.mapInput(input_file_name);
+                ByteSpan span{input.data(), input.size()};
+                bool output_mapped = false;
+                // the output file takes the size of the count, which must fit the archive
+                long long payload = memory_map ? payloadBytes(source) : -1;
+                if (memory_map && !write_stdout && countInHeader() && wholeRange() && payload >= 0 && countFits(payload)) {
+                    out.close();
+                    output_mapped = output.mapOutput(output_file_name, count);
+                    if (!output_mapped) {
+                        out.open(output_file_name);
+                        if (!out) throw std::invalid_argument("Unable to open output file");
+                    }
+                }
+                decodeArchive(source, destination, input_mapped ? &span : nullptr, output_mapped ? output.data() : nullptr);
+                in.close();
+                out.close();
+                if (write_stdout) std::cout.flush();
+            }
+            if (print_stat && statistics_format != StatisticsFormat::sizes)
+                statistics.write(write_stdout ? std::cerr : std::cout, statistics_format);
+            else if (print_stat)
+                (write_stdout ? std::cerr : std::cout) << input_size - extra_bytes << std::endl << output_size
+                                                       << std::endl << extra_bytes << std::endl;
             if (clear_on_exit)
                 clear();
         }
         catch (std::invalid_argument &e) {
             in.close();
             out.close();
+            if (created) std::remove(output_file_name.c_str());
             throw e;
         }
         catch (std::exception &e) {
             in.close();
             out.close();
+            if (created) std::remove(output_file_name.c_str());
             throw e;
         }
     }
 
+    void Tree::checkSettings() const {
+        if (max_code_length < min_code_length_limit || max_code_length > max_code_length_limit)
+            throw std::invalid_argument("Invalid maximum code length");
+        if (block_size != 0 && (block_size < min_block_size || block_size > max_block_size))
+            throw std::invalid_argument("Invalid block size");
+        if (streams < 1 || streams > max_streams || (streams & (streams - 1)) != 0)
+            throw std::invalid_argument("Invalid stream count");
+        if (adaptive + context + !table_file.empty() > 1)
+            throw std::invalid_argument("Conflicting coding modes");
+    }
+
+    // Codes the input adaptively in one pass, or when it is seekable as a block archive or with a single
+    // table, reading it in place when given. Single tables fall back to a stream archive otherwise.
+    void Tree::encodeArchive(std::istream &in, std::ostream &out, const ByteSpan *input) {
+        if (adaptive) {
+            format = adaptive_format;
+            encodeAdaptive(in, out, input);
+            return;
+        }
+        if (context) {
+            format = context_format;
+            encodeContext(in, out, input);
+            return;
+        }
+        // the size is all a trained table needs to know about the input, its codes are ready
+        if (!table_file.empty()) {
+            format = trained_format;
+            loadTrainedTable();
+            // trained tables are meant for small inputs, one that cannot seek is read into memory for its size
+            std::vector<char> unseekable;
+            ByteSpan span;
+            if (input == nullptr && in.tellg() < 0) {
+                PhaseTimer timer(statistics.io);
+                unseekable.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+                span = ByteSpan{unseekable.data(), unseekable.size()};
+                input = &span;
+            }
+            if (input != nullptr) {
+                count = input->size;
+            } else {
+                in.seekg(0, std::ios::end);
+                count = in.tellg();
+                if (!in.seekg(0) || count < 0) throw std::invalid_argument("Input must be seekable");
+            }
+            input_size = count;
+            encodeAndWriteCompressed(in, out, input);
+            return;
+        }
+        if (block_size != 0) {
+            format = block_format;
+            encodeBlocks(in, out, input);
+            return;
+        }
+        // a single table needs a second pass over the input, streams that cannot seek get framed blocks
+        if (input == nullptr && in.tellg() < 0) {
+            format = stream_format;
+            encodeStream(in, out);
+            return;
+        }
+        if (input != nullptr) {
+            loadRawEntries((unsigned char *) input->data, input->size);
+        } else {
+            loadRawEntries(in);
+            in.clear();
+            if (!in.seekg(0)) throw std::invalid_argument("Input must be seekable");
+        }
+        buildTree();
+        stream_count = streams;
+        if (stream_count > 1)
+            format = interleaved_format;
+        encodeAndWriteCompressed(in, out, input);
+    }
+
+    void Tree::checkRange() {
+        if (range_offset < 0 || range_length < -1)
+            throw std::invalid_argument("Invalid range");
+        range_end = range_length < 0 || range_length > LLONG_MAX - range_offset ? LLONG_MAX
+                                                                               : range_offset + range_length;
+    }
+
+    // Decodes the archive whose header loadEncodedTree has read. Output, when given, holds all count bytes.
+    void Tree::decodeArchive(std::istream &in, std::ostream &out, const ByteSpan *input, char *output) {
+        if (format == stream_format) {
+            decodeStream(in, out);
+        } else if (format == adaptive_format) {
+            decodeAdaptive(in, out, input);
+        } else if (format == context_format) {
+            decodeContext(in, out, input, output);
+        } else if (format == block_format) {
+            decodeBlocks(in, out, input, output);
+        } else {
+            buildTree();
+            decodeAndWriteText(in, out, input, output);
+        }
+    }
+
+    size_t Tree::encodeBuffer(const char *data, size_t size, std::vector<char> &out) {
+        MeasuredCall call(*this, true);
+        MemoryBuffer input(data, size), output(out);
+        std::istream in(&input);
+        std::ostream archive(&output);
+        clear();
+        checkSettings();
+        ByteSpan span{data, size};
+        encodeArchive(in, archive, &span);
+        out.resize(output.size());
+        return output.size();
+    }
+
+    size_t Tree::encodeBuffer(const char *data, size_t size, char *out, size_t capacity) {
+        MeasuredCall call(*this, true);
+        MemoryBuffer input(data, size), output(out, capacity);
+        std::istream in(&input);
+        std::ostream archive(&output);
+        clear();
+        checkSettings();
+        ByteSpan span{data, size};
+        encodeArchive(in, archive, &span);
+        if (!archive) throw std::invalid_argument("Output buffer is too small");
+        return output.size();
+    }
+
+    size_t Tree::decodeBuffer(const char *data, size_t size, std::vector<char> &out) {
+        MeasuredCall call(*this, false);
+        MemoryBuffer input(data, size), output(out);
+        std::istream in(&input);
+        std::ostream text(&output);
+        clear();
+        checkRange();
+        loadEncodedTree(in);
+        ByteSpan span{data, size};
+        if (countInHeader() && wholeRange()) {
+            out.resize(count);
+            decodeArchive(in, text, &span, out.data());
+            return count;
+        }
+        decodeArchive(in, text, &span);
+        out.resize(output.size());
+        return output.size();
+    }
+
+    size_t Tree::decodeBuffer(const char *data, size_t size, char *out, size_t capacity) {
+        MeasuredCall call(*this, false);
+        MemoryBuffer input(data, size), output(out, capacity);
+        std::istream in(&input);
+        std::ostream text(&output);
+        clear();
+        checkRange();
+        loadEncodedTree(in);
+        ByteSpan span{data, size};
+        if (countInHeader() && wholeRange()) {
+            if ((size_t) count > capacity) throw std::invalid_argument("Output buffer is too small");
+            decodeArchive(in, text, &span, out);
+            return count;
+        }
+        decodeArchive(in, text, &span);
+        if (!text) throw std::invalid_argument("Output buffer is too small");
+        return output.size();
+    }
+
+    size_t Tree::maxEncodedSize(size_t size) const {
+        // adaptive (FGK) codes take at most twice the bits of static codes plus one per byte (Knuth),
+        // and each of the 256 new symbols and the end marker adds a path through at most 256 levels
+        if (adaptive)
+            return sizeof(format) + (17 * size + (max_chars + 1) * (max_chars + byte_size + 1)) / byte_size + 1;
+        // trained codes can be longer than 8 bits for bytes that were rare in the samples
+        if (!table_file.empty()) {
+            int longest = table_file == loaded_table_file ? *std::max_element(trained_lengths, trained_lengths + max_chars)
+                                                          : max_code_length_limit;
+            return sizeof(format) + sizeof(trained_table_id) + sizeof(count) + (size * longest + byte_size - 1) / byte_size;
+        }
+        // every group codes its bytes in at most 8 bits each, as in single-table archives
+        if (context)
+            return sizeof(format) + sizeof(count) + ContextModel::max_header_bytes + size + 1;
+        // a block is stored when coding does not make it smaller
+        if (block_size != 0) {
+            size_t blocks = (size + block_size - 1) / block_size;
+            size_t frame_bytes = sizeof(stored_block) + sizeof(count);
+            return 3 * sizeof(format) + blocks * (sizeof(BlockIndexEntry) + frame_bytes) + size;
+        }
+        // a table is at most the count, the number of symbols and a (symbol, length) pair per byte value,
+        // and optimal codes never take more than the 8 bits per byte of a flat code
+        size_t table_bytes = sizeof(count) + sizeof(unsigned short) + 2 * max_chars;
+        size_t groups = (size + interleaved_chunk_size - 1) / interleaved_chunk_size;
+        size_t group_bytes = streams > 1 ? streams * (sizeof(unsigned int) + 1) : 1;
+        return sizeof(format) + table_bytes + 1 + groups * group_bytes + size;
+    }
+
+    long long Tree::decodedSize(const char *data, size_t size) {
+        MemoryBuffer input(data, size);
+        std::istream in(&input);
+        clear();
+        loadEncodedTree(in);
+        long long decoded = countInHeader() ? count : -1;
+        clear();
+        return decoded;
+    }
+
     void Tree::clear() {
-        for (auto &code: codes)
-            code.clear();
-        delete root;
-        root = nullptr;
+        std::fill(encode_table, encode_table + max_chars, EncodeEntry());
+        pair_coding = false;
+        multi_decoding = false;
+        node_count = 0;
+        heap_size = 0;
+        root = no_node;
         std::fill(entries, entries + max_chars, 0);
+        std::fill(lengths, lengths + max_chars, 0);
         count = 0;
+        block_count = 0;
+        block_index.clear();
+        format = canonical_format;
+        range_end = LLONG_MAX;
+        lengths_loaded = false;
+        extra_bytes = 0;
         input_size = 0;
         output_size = 0;
     }
 
+    std::vector<bool> Tree::code(unsigned char symbol) const {
+        const EncodeEntry &entry = encode_table[symbol];
+        std::vector<bool> bits(entry.length);
+        for (int k = 0; k < entry.length && k < (int) sizeof(entry.code) * byte_size; k++)
+            bits[entry.length - 1 - k] = (entry.code >> k) & 1;
+        return bits;
+    }
+
     Tree::Tree() {
         std::fill(entries, entries + max_chars, 0);
+        std::fill(lengths, lengths + max_chars, 0);
     }
 
 
-    Node::Node(std::vector<unsigned char> chars, long long frequency, Node *left_child, Node *right_child)
-            : chars(std::move(chars)), frequency(frequency), left_child(left_child), right_child(right_child) {}
+    BitWriter::BitWriter(std::ostream &out) : buffer(&own_buffer), out(&out) {
+        own_buffer.reserve(buffer_size);
+    }
+
+    BitWriter::BitWriter(std::ostream &out, std::vector<char> &buffer) : buffer(&buffer), out(&out) {
+        buffer.clear();
+        buffer.reserve(buffer_size);
+    }
 
+    BitWriter::BitWriter(std::vector<char> &sink) : buffer(&sink), out(nullptr) {}
 
-    Node::~Node() {
-        delete left_child;
-        delete right_child;
+    void BitWriter::spill() {
+        if (buffer->size() + sizeof(acc) > buffer_size) writeBuffer();
+        while (acc_bits >= byte_size) {
+            acc_bits -= byte_size;
+            buffer->push_back((char) (acc >> acc_bits));
+        }
     }
 
-    BitWriter::BitWriter(std::ofstream &out) : out(out) {}
+    void BitWriter::align() {
+        spill();
+        if (acc_bits > 0) {
+            buffer->push_back((char) (acc << (byte_size - acc_bits)));
+            acc_bits = 0;
+        }
+    }
+
+    void BitWriter::writeBuffer() {
+        if (out == nullptr) return;
+        out->write(buffer->data(), buffer->size());
+        buffer->clear();
+    }
 
+    void BitWriter::writeBytes(const char *data, size_t size) {
+        align();
+        if (buffer->size() + size > buffer_size) writeBuffer();
+        if (out != nullptr && size > buffer_size)
+            out->write(data, size);
+        else
+            buffer->insert(buffer->end(), data, data + size);
+    }
 
     void BitWriter::flush() {
-        if (byte_index > 0) {
-            out.write((char *) &byte, sizeof(char));
+        align();
+        writeBuffer();
+    }
+
+    BitReader::BitReader(std::istream &in) : in(&in) {}
+
+    BitReader::BitReader(std::istream &in, std::vector<char> &buffer) : external_block(&buffer), in(&in) {}
+
+    BitReader::BitReader(const char *data, size_t size) : data(data), block_end(size), in(nullptr) {}
+
+    void BitReader::refillTail() {
+        while (bit_count <= max_peek_bits) {
+            if (block_pos == block_end) {
+                if (in == nullptr) return;
+                std::vector<char> &storage = external_block != nullptr ? *external_block : block;
+                storage.resize(buffer_size);
+                in->read(storage.data(), buffer_size);
+                data = storage.data();
+                block_pos = 0;
+                block_end = in->gcount();
+                if (block_end == 0) return;
+                if (block_end >= 8) {
+                    refill();
+                    return;
+                }
+            }
+            bits |= (unsigned long long) (unsigned char) data[block_pos++] << (56 - bit_count);
+            bit_count += byte_size;
         }
     }
 
-    BitReader::BitReader(std::ifstream &in) : in(in) {}
+    BitReader &BitReader::readBytes(char *out, std::streamsize size) {
+        consume(bit_count % byte_size);
+        for (; size > 0 && bit_count > 0; size--) {
+            *out++ = (char) (bits >> 56);
+            consume(byte_size);
+        }
+        std::streamsize from_block = std::min(size, block_end - block_pos);
+        std::copy(data + block_pos, data + block_pos + from_block, out);
+        block_pos += from_block;
+        size -= from_block;
+        if (size > 0) {
+            if (in != nullptr) in->read(out + from_block, size);
+            if (in == nullptr || in->gcount() != size)
+                failed = true;
+        }
+        return *this;
+    }
 
     BitReader::operator bool() const {
-        return in.operator bool();
+        return !failed;
     }
 
 }
@@ -1,26 +1,106 @@
 #include <iostream>
 #include "huffman.h"
+#include "benchmark.h"
 #include "cstring"
 #include "cassert"
 
+// Comma separated values, such as 1,2,4
+std::vector<long long> parseList(const char* arg) {
+    std::vector<long long> values;
+    for (const char* p = arg; ; p++) {
+        values.push_back(atoll(p));
+        p = strchr(p, ',');
+        if (p == nullptr) break;
+    }
+    return values;
+}
+
 int main(int argc, char* argv[]) {
     std::string input_file_name, output_file_name;
+    std::vector<std::string> input_file_names;
     int mode = -1;
+    int iterations = 5;
+    Huffman::Tree t;
+    // Settings the benchmark mode runs with, every combination of them. The other modes take the first ones.
+    std::vector<long long> block_sizes = {t.block_size}, thread_counts = {t.threads},
+            code_lengths = {t.max_code_length}, stream_counts = {t.streams};
     for (int i = 0; i < argc; i++) {
         if (!strcmp(argv[i], "-c")) mode = 0;
         else if (!strcmp(argv[i], "-u")) mode = 1;
+        else if (!strcmp(argv[i], "--train")) mode = 2;
+        else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--benchmark")) mode = 3;
+        else if (!strcmp(argv[i], "--iterations")) {
+            iterations = atoi(argv[i+1]);
+            i++;
+        }
         else if (!strcmp(argv[i], "-f") || !strcmp(argv[i], "--file")) {
             input_file_name = argv[i+1];
+            input_file_names.push_back(input_file_name);
+            i++;
+        }
+        else if (!strcmp(argv[i], "--stats")) {
+            t.statistics_format = Huffman::parseStatisticsFormat(argv[i+1]);
+            i++;
+        }
+        else if (!strcmp(argv[i], "--table")) {
+            t.table_file = argv[i+1];
             i++;
         }
         else if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) {
             output_file_name = argv[i+1];
             i++;
         }
+        else if (!strcmp(argv[i], "-l") || !strcmp(argv[i], "--max-code-length")) {
+            code_lengths = parseList(argv[i+1]);
+            i++;
+        }
+        else if (!strcmp(argv[i], "--block-size")) {
+            block_sizes = parseList(argv[i+1]);
+            i++;
+        }
+        else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--threads")) {
+            thread_counts = parseList(argv[i+1]);
+            i++;
+        }
+        else if (!strcmp(argv[i], "--streams")) {
+            stream_counts = parseList(argv[i+1]);
+            i++;
+        }
+        else if (!strcmp(argv[i], "--offset")) {
+            t.range_offset = atoll(argv[i+1]);
+            i++;
+        }
+        else if (!strcmp(argv[i], "--length")) {
+            t.range_length = atoll(argv[i+1]);
+            i++;
+        }
+        else if (!strcmp(argv[i], "--adaptive")) t.adaptive = true;
+        else if (!strcmp(argv[i], "--context")) t.context = true;
+        else if (!strcmp(argv[i], "--mmap")) t.memory_map = true;
+    }
+    t.block_size = block_sizes[0];
+    t.threads = thread_counts[0];
+    t.max_code_length = code_lengths[0];
+    t.streams = stream_counts[0];
+    if (mode == 3) {
+        assert(!input_file_name.empty());
+        Huffman::Benchmark benchmark(input_file_name);
+        for (long long block_size: block_sizes)
+            for (long long threads: thread_counts)
+                for (long long max_code_length: code_lengths)
+                    for (long long streams: stream_counts) {
+                        t.block_size = block_size;
+                        t.threads = threads;
+                        t.max_code_length = max_code_length;
+                        t.streams = streams;
+                        Huffman::Benchmark::print(std::cout, t, benchmark.run(t, iterations));
+                    }
+        return 0;
     }
-    Huffman::Tree t;
     assert(mode != -1 && !input_file_name.empty() && !output_file_name.empty());
-    if (mode == 0)
+    if (mode == 2)
+        t.trainTable(input_file_names, output_file_name, true);
+    else if (mode == 0)
         t.encodeFile(input_file_name, output_file_name, true);
     else
         t.decodeFile(input_file_name, output_file_name, true);
@@ -0,0 +1,74 @@
+#include "mapped_file.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HUFFMAN_HAS_MMAP
+#endif
+
+namespace Huffman {
+
+    MappedFile::~MappedFile() {
+        close();
+    }
+
+#ifdef HUFFMAN_HAS_MMAP
+    bool MappedFile::mapInput(const std::string &file_name) {
+        close();
+        int fd = open(file_name.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st{};
+        bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && map(fd, st.st_size, false);
+        ::close(fd);
+        return ok;
+    }
+
+    bool MappedFile::mapOutput(const std::string &file_name, size_t size) {
+        close();
+        struct stat st{};
+        if (stat(file_name.c_str(), &st) == 0 && !S_ISREG(st.st_mode)) return false;
+        int fd = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return false;
+        bool ok = ftruncate(fd, size) == 0 && map(fd, size, true);
+        ::close(fd);
+        return ok;
+    }
+
+    bool MappedFile::map(int fd, size_t size, bool writable) {
+        if (size > 0) {
+            void *mapping = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+            if (mapping == MAP_FAILED) return false;
+            address = (char *) mapping;
+            madvise(address, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+            madvise(address, size, MADV_HUGEPAGE);
+#endif
+        }
+        length = size;
+        return true;
+    }
+
+    void MappedFile::close() {
+        if (address != nullptr)
+            munmap(address, length);
+        address = nullptr;
+        length = 0;
+    }
+#else
+    bool MappedFile::mapInput(const std::string &) {
+        return false;
+    }
+
+    bool MappedFile::mapOutput(const std::string &, size_t) {
+        return false;
+    }
+
+    bool MappedFile::map(int, size_t, bool) {
+        return false;
+    }
+
+    void MappedFile::close() {}
+#endif
+}
@@ -0,0 +1,58 @@
+#include "memory_buffer.h"
+#include <algorithm>
+
+namespace Huffman {
+
+    MemoryBuffer::MemoryBuffer(const char *data, size_t size) {
+        char *begin = const_cast<char *>(data); // the get area is never written through
+        setg(begin, begin, begin + size);
+    }
+
+    MemoryBuffer::MemoryBuffer(char *data, size_t capacity) : out(data), capacity(capacity) {}
+
+    MemoryBuffer::MemoryBuffer(std::vector<char> &sink) : sink(&sink) {
+        sink.clear();
+    }
+
+    std::streamsize MemoryBuffer::xsputn(const char *s, std::streamsize n) {
+        if (sink != nullptr) {
+            if (position + n > sink->size())
+                sink->resize(position + n);
+            out = sink->data();
+        } else {
+            n = std::min<std::streamsize>(n, capacity - position);
+        }
+        std::copy(s, s + n, out + position);
+        position += n;
+        written = std::max(written, position);
+        return n;
+    }
+
+    MemoryBuffer::int_type MemoryBuffer::overflow(int_type c) {
+        if (traits_type::eq_int_type(c, traits_type::eof()))
+            return traits_type::not_eof(c);
+        char byte = traits_type::to_char_type(c);
+        return xsputn(&byte, 1) == 1 ? c : traits_type::eof();
+    }
+
+    MemoryBuffer::pos_type MemoryBuffer::seekoff(off_type off, std::ios_base::seekdir dir,
+                                                 std::ios_base::openmode which) {
+        if (which & std::ios_base::in) {
+            off_type base = dir == std::ios_base::beg ? 0 : dir == std::ios_base::cur ? gptr() - eback()
+                                                                                     : egptr() - eback();
+            if (base + off < 0 || base + off > egptr() - eback())
+                return pos_type(off_type(-1));
+            setg(eback(), eback() + base + off, egptr());
+            return pos_type(base + off);
+        }
+        off_type base = dir == std::ios_base::beg ? 0 : dir == std::ios_base::cur ? position : written;
+        if (base + off < 0 || (sink == nullptr && (size_t) (base + off) > capacity))
+            return pos_type(off_type(-1));
+        position = base + off;
+        return pos_type(position);
+    }
+
+    MemoryBuffer::pos_type MemoryBuffer::seekpos(pos_type pos, std::ios_base::openmode which) {
+        return seekoff(off_type(pos), std::ios_base::beg, which);
+    }
+}
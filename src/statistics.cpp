@@ -0,0 +1,111 @@
+#include "statistics.h"
+#include <cmath>
+#include <utility>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <time.h>
+#define HUFFMAN_HAS_RUSAGE
+#endif
+
+namespace Huffman {
+
+    namespace {
+        // CPU time of the calling thread where the platform tells, so that the timers of concurrent
+        // workers do not count each other
+        double cpuSeconds(bool whole_process) {
+#if defined(HUFFMAN_HAS_RUSAGE) && defined(CLOCK_THREAD_CPUTIME_ID)
+            if (!whole_process) {
+                timespec now;
+                clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+                return now.tv_sec + now.tv_nsec / 1e9;
+            }
+#endif
+            return (double) std::clock() / CLOCKS_PER_SEC;
+        }
+    }
+
+    void Statistics::addHistogram(const long long *histogram, int symbols) {
+        long long total = 0;
+        for (int i = 0; i < symbols; i++)
+            total += histogram[i];
+        for (int i = 0; i < symbols; i++)
+            if (histogram[i] != 0)
+                entropy_bits += histogram[i] * std::log2((double) total / histogram[i]);
+        counted_bytes += total;
+    }
+
+    void Statistics::addPhases(const Statistics &other) {
+        histogram += other.histogram;
+        tree += other.tree;
+        coding += other.coding;
+        io += other.io;
+        entropy_bits += other.entropy_bits;
+        counted_bytes += other.counted_bytes;
+    }
+
+    void Statistics::finish(long long input, long long output, long long header, long long data, bool encoded) {
+        input_bytes = input;
+        output_bytes = output;
+        header_bytes = header;
+        data_bytes = data;
+        long long archive = encoded ? output : input;
+        code_length = data != 0 ? (double) (archive - header) * 8 / data : 0;
+        entropy = counted_bytes != 0 ? entropy_bits / counted_bytes : -1;
+        peak_memory = peakMemory();
+    }
+
+    StatisticsFormat parseStatisticsFormat(const std::string &name) {
+        if (name == "json") return StatisticsFormat::json;
+        if (name == "kv") return StatisticsFormat::key_value;
+        throw std::invalid_argument("Invalid statistics format");
+    }
+
+    void Statistics::write(std::ostream &out, StatisticsFormat format) const {
+        const std::pair<const char *, const PhaseTime *> phases[] = {
+                {"histogram", &histogram}, {"tree", &tree}, {"coding", &coding}, {"io", &io}, {"total", &total}};
+        if (format == StatisticsFormat::json) {
+            out << "{\"input_bytes\": " << input_bytes << ", \"output_bytes\": " << output_bytes
+                << ", \"header_bytes\": " << header_bytes << ", \"data_bytes\": " << data_bytes
+                << ", \"code_length\": " << code_length << ", \"entropy\": " << entropy
+                << ", \"peak_memory\": " << peak_memory;
+            for (auto &phase: phases)
+                out << ", \"" << phase.first << "\": {\"wall\": " << phase.second->wall << ", \"cpu\": "
+                    << phase.second->cpu << "}";
+            out << "}" << std::endl;
+            return;
+        }
+        out << "input_bytes=" << input_bytes << std::endl << "output_bytes=" << output_bytes << std::endl
+            << "header_bytes=" << header_bytes << std::endl << "data_bytes=" << data_bytes << std::endl
+            << "code_length=" << code_length << std::endl << "entropy=" << entropy << std::endl
+            << "peak_memory=" << peak_memory << std::endl;
+        for (auto &phase: phases)
+            out << phase.first << "_wall=" << phase.second->wall << std::endl
+                << phase.first << "_cpu=" << phase.second->cpu << std::endl;
+    }
+
+    PhaseTimer::PhaseTimer(PhaseTime &phase, bool whole_process)
+            : phase(phase), whole_process(whole_process), wall_start(std::chrono::steady_clock::now()),
+              cpu_start(cpuSeconds(whole_process)) {}
+
+    PhaseTimer::~PhaseTimer() {
+        std::chrono::duration<double> wall = std::chrono::steady_clock::now() - wall_start;
+        phase.wall += wall.count();
+        phase.cpu += cpuSeconds(whole_process) - cpu_start;
+    }
+
+    long long peakMemory() {
+#ifdef HUFFMAN_HAS_RUSAGE
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+        return usage.ru_maxrss;
+#else
+        return usage.ru_maxrss * 1024LL;
+#endif
+#else
+        return 0;
+#endif
+    }
+}
@@ -0,0 +1,131 @@
+#include "stream_coder.h"
+#include <algorithm>
+#include <cstring>
+
+namespace Huffman {
+
+    void Encoder::start(std::vector<char> &out) {
+        if (finished) throw std::invalid_argument("Encoder is finished");
+        if (started) return;
+        tree.max_code_length = max_code_length;
+        tree.block_size = block_size != 0 ? block_size : Tree::default_stream_block_size;
+        tree.streams = streams;
+        tree.checkSettings();
+        long long format = Tree::stream_format;
+        out.insert(out.end(), (const char *) &format, (const char *) &format + sizeof(format));
+        pending.reserve(tree.block_size);
+        started = true;
+    }
+
+    void Encoder::update(const char *data, size_t size, std::vector<char> &out) {
+        start(out);
+        while (size > 0) {
+            // whole blocks are coded in place when nothing is waiting
+            if (pending.empty() && (long long) size >= tree.block_size) {
+                writeFrame(data, tree.block_size, out);
+                data += tree.block_size;
+                size -= tree.block_size;
+                continue;
+            }
+            size_t taken = std::min<size_t>(size, tree.block_size - pending.size());
+            pending.insert(pending.end(), data, data + taken);
+            data += taken;
+            size -= taken;
+            if ((long long) pending.size() == tree.block_size) {
+                writeFrame(pending.data(), pending.size(), out);
+                pending.clear();
+            }
+        }
+    }
+
+    void Encoder::flush(std::vector<char> &out) {
+        start(out);
+        if (pending.empty()) return;
+        writeFrame(pending.data(), pending.size(), out);
+        pending.clear();
+    }
+
+    void Encoder::finish(std::vector<char> &out) {
+        flush(out);
+        long long end = 0;
+        out.insert(out.end(), (const char *) &end, (const char *) &end + sizeof(end));
+        out.insert(out.end(), (const char *) &end, (const char *) &end + sizeof(end));
+        finished = true;
+    }
+
+    // Same frame as Tree::encodeStream: decompressed size, frame size, then the block as coded by encodeBlock
+    void Encoder::writeFrame(const char *data, size_t size, std::vector<char> &out) {
+        long long block_bytes = size, frame_size = 0;
+        size_t header = out.size();
+        out.resize(header + sizeof(block_bytes) + sizeof(frame_size));
+        {
+            BitWriter writer(out);
+            tree.encodeBlock((const unsigned char *) data, size, writer);
+            writer.flush();
+        }
+        frame_size = out.size() - header - sizeof(block_bytes) - sizeof(frame_size);
+        std::memcpy(out.data() + header, &block_bytes, sizeof(block_bytes));
+        std::memcpy(out.data() + header + sizeof(block_bytes), &frame_size, sizeof(frame_size));
+    }
+
+    void Decoder::update(const char *data, size_t size) {
+        // drop what was consumed once it is most of the buffer
+        if (input_position > 0 && input_position >= input.size() / 2) {
+            input.erase(input.begin(), input.begin() + input_position);
+            input_position = 0;
+        }
+        input.insert(input.end(), data, data + size);
+    }
+
+    size_t Decoder::read(char *out, size_t capacity) {
+        size_t copied = 0;
+        while (copied < capacity) {
+            if (decoded_position == decoded.size() && !decodeFrame())
+                break;
+            size_t taken = std::min(capacity - copied, decoded.size() - decoded_position);
+            std::copy(decoded.data() + decoded_position, decoded.data() + decoded_position + taken, out + copied);
+            decoded_position += taken;
+            copied += taken;
+        }
+        return copied;
+    }
+
+    bool Decoder::finished() const {
+        return ended && decoded_position == decoded.size();
+    }
+
+    // Decodes the next frame if all of it has arrived, the same checks as in Tree::decodeStream
+    bool Decoder::decodeFrame() {
+        if (ended) return false;
+        const char *data = input.data() + input_position;
+        size_t available = input.size() - input_position;
+        if (!started) {
+            long long format;
+            if (available < sizeof(format)) return false;
+            std::memcpy(&format, data, sizeof(format));
+            if (format != Tree::stream_format) throw std::invalid_argument("Header data not found");
+            input_position += sizeof(format);
+            started = true;
+            return decodeFrame();
+        }
+        long long size, frame_size;
+        if (available < sizeof(size) + sizeof(frame_size)) return false;
+        std::memcpy(&size, data, sizeof(size));
+        std::memcpy(&frame_size, data + sizeof(size), sizeof(frame_size));
+        if (size < 0 || size > Tree::max_block_size || frame_size < 0
+            || frame_size > (long long) (sizeof(Tree::stored_block) + sizeof(size)) + size)
+            throw std::invalid_argument("Header data not found");
+        if (size == 0) {
+            input_position += sizeof(size) + sizeof(frame_size);
+            ended = true;
+            return false;
+        }
+        if (available < sizeof(size) + sizeof(frame_size) + frame_size) return false;
+        BitReader reader(data + sizeof(size) + sizeof(frame_size), frame_size);
+        decoded.resize(size);
+        tree.decodeBlock(reader, decoded.data(), size);
+        decoded_position = 0;
+        input_position += sizeof(size) + sizeof(frame_size) + frame_size;
+        return true;
+    }
+}
@@ -5,8 +5,33 @@
 #include <fstream>
 #include <iterator>
 #include <string>
+#include <sstream>
 #include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <functional>
 #include "huffman.h"
+#include "stream_coder.h"
+#include "context_model.h"
+#include "benchmark.h"
+#include "test_data.h"
+
+// Heap allocations of the whole program, for checking that a reused Tree no longer allocates
+static long long allocation_count = 0;
+
+void* operator new(std::size_t size) {
+    allocation_count++;
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
 
 std::string resource_path(const std::string& filename) {
     static std::string resources_folder = "./test/resources/";
@@ -32,10 +57,20 @@ bool files_are_same(const std::string& p1, const std::string& p2) {
                       std::istreambuf_iterator<char>(f2.rdbuf()));
 }
 
-void encode_decode_compare(std::string input) {
+std::string read_file(const std::string &name) {
+    std::ifstream in(name);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void encode_decode_compare(std::string input, long long block_size = 0, int threads = 0, bool memory_map = false,
+                           int streams = 1) {
     std::string encoded = resource_path("encoded.bin");
     std::string actual = resource_path("actual.txt");
     Huffman::Tree t;
+    t.block_size = block_size;
+    t.threads = threads;
+    t.memory_map = memory_map;
+    t.streams = streams;
     t.encodeFile(input, encoded);
     t.decodeFile(encoded, actual);
     CHECK(files_are_same(input, actual));
@@ -43,6 +78,61 @@ void encode_decode_compare(std::string input) {
     remove(actual.c_str());
 }
 
+// Round trips with the coding mode that setup turns on, for both the encoder and the decoder: every
+// file by streams and by mapped files, then every text through the buffer API. header_bytes is the
+// expected header of the files when it is fixed, and the count is in the header unless the mode
+// only ends with a marker. Returns the archive size of every text, for comparing it with other modes.
+std::vector<size_t> mode_round_trip(const std::function<void(Huffman::Tree&)>& setup,
+                                    const std::vector<std::string>& names, const std::vector<std::string>& texts,
+                                    long long header_bytes = -1, bool count_in_header = true) {
+    std::string encoded = resource_path("encoded.bin");
+    std::string actual = resource_path("actual.txt");
+    for (auto& name: names) {
+        CAPTURE(name);
+        std::string input = resource_path(name);
+        for (bool memory_map: {false, true}) {
+            CAPTURE(memory_map);
+            Huffman::Tree t;
+            setup(t);
+            t.memory_map = memory_map;
+            t.encodeFile(input, encoded, false, false);
+            if (header_bytes >= 0)
+                CHECK_EQ(t.extra_bytes, header_bytes);
+            CHECK_EQ(t.output_size, (long long) read_file(encoded).size());
+            Huffman::Tree u;
+            setup(u);
+            u.memory_map = memory_map;
+            u.decodeFile(encoded, actual, false, false);
+            CHECK_EQ(u.output_size, (long long) read_file(input).size());
+            CHECK_EQ(u.input_size, t.output_size);
+            CHECK_EQ(u.extra_bytes, t.extra_bytes);
+            CHECK(files_are_same(input, actual));
+        }
+    }
+    remove(encoded.c_str());
+    remove(actual.c_str());
+
+    std::vector<size_t> sizes;
+    for (auto& text: texts) {
+        Huffman::Tree t;
+        setup(t);
+        std::vector<char> archive, decoded;
+        sizes.push_back(t.encodeBuffer(text.data(), text.size(), archive));
+        CHECK(archive.size() <= t.maxEncodedSize(text.size()));
+        CHECK_EQ(t.decodedSize(archive.data(), archive.size()), count_in_header ? (long long) text.size() : -1);
+        CHECK_EQ(t.decodeBuffer(archive.data(), archive.size(), decoded), text.size());
+        CHECK(std::string(decoded.begin(), decoded.end()) == text);
+    }
+    return sizes;
+}
+
+// Archive size of the default single-table mode, what the other modes are measured against
+size_t single_table_size(const std::string& text) {
+    Huffman::Tree t;
+    std::vector<char> archive;
+    return t.encodeBuffer(text.data(), text.size(), archive);
+}
+
 TEST_CASE("BitWriter::operator<<") {
     SUBCASE("bool") {
         std::string output = resource_path("out.bin");
@@ -59,6 +149,28 @@ TEST_CASE("BitWriter::operator<<") {
         CHECK_EQ(actual, 'a');
     }
 
+    SUBCASE("whole codes") {
+        std::string output = resource_path("out.bin");
+        std::ofstream out(output);
+        Huffman::BitWriter w(out);
+        w.write(3, 3); //011
+        w.write(1, 5); //00001
+        w.write(0x6263, 16); //"bc"
+        bool t = 1;
+        w << t; //1 padded to 10000000
+        int expected = 42;
+        w << expected;
+        w.flush();
+        out.close();
+        std::ifstream in(output);
+        char actual[8];
+        in.read(actual, sizeof(actual));
+        remove(output.c_str());
+        CHECK_EQ(std::string(actual, 3), "abc");
+        CHECK_EQ((unsigned char) actual[3], 0x80);
+        CHECK_EQ(actual[4], expected);
+    }
+
     SUBCASE("int") {
         std::string output = resource_path("out.bin");
         std::ofstream out(output);
@@ -87,6 +199,26 @@ TEST_CASE("BitReader::operator>>") {
         CHECK_EQ(b, 1);
     }
 
+    SUBCASE("peek and consume") {
+        std::string input = resource_path("a-z0-9.txt");
+        std::ifstream in(input);
+        Huffman::BitReader r(in);
+        r.refill();
+        CHECK_EQ(r.peek(16), ('a' << 8) | 'b');
+        r.consume(12);
+        CHECK_EQ(r.peek(4), 'b' & 0xf);
+        r.consume(4);
+        char c;
+        r >> c;
+        CHECK_EQ(c, 'c');
+        for (int i = 0; i < 33; i++) {
+            r.refill();
+            r.consume(Huffman::byte_size);
+        }
+        CHECK_EQ(r.available(), 0);
+        CHECK_EQ(r.peek(8), 0);
+    }
+
     SUBCASE("char") {
         std::string input = resource_path("a.txt");
         std::ifstream in(input);
@@ -155,7 +287,29 @@ TEST_CASE("Tree::loadRawEntries") {
         unsigned char c = 'a';
         expected[c] = 10000;
         CHECK(std::equal(t.entries, t.entries + Huffman::Tree::max_chars, expected));
+        // the read buffer is no larger than the file
+        CHECK_EQ(t.read_buffer.size(), 10000);
+        in.close();
+    }
+    SUBCASE("several chunks counted on several threads") {
+        std::string input = resource_path("chunks.bin");
+        long long expected[Huffman::Tree::max_chars];
+        std::fill(expected, expected + Huffman::Tree::max_chars, 0);
+        std::vector<char> data(2 * Huffman::Tree::histogram_chunk_size + 12345);
+        for (size_t i = 0; i < data.size(); i++) {
+            data[i] = (char) (i * i % 251);
+            expected[(unsigned char) data[i]]++;
+        }
+        std::ofstream out(input);
+        out.write(data.data(), data.size());
+        out.close();
+        std::ifstream in(input);
+        t.threads = 2;
+        t.loadRawEntries(in);
+        CHECK(std::equal(t.entries, t.entries + Huffman::Tree::max_chars, expected));
+        CHECK_EQ(t.count, data.size());
         in.close();
+        remove(input.c_str());
     }
 }
 
@@ -164,21 +318,67 @@ TEST_CASE("Tree::mergeTree") {
 
     SUBCASE("expected empty tree on empty entries array") {
         t.mergeTree();
-        CHECK_EQ(t.root, nullptr);
+        CHECK_EQ(t.root, Huffman::no_node);
         CHECK(std::all_of(t.entries, t.entries + t.max_chars, [](int i){ return i == 0; }));
         t.clear();
     }
 
     SUBCASE("merge tree when all bytes are present once") {
         for (int i = 0; i < 256; i++) {
-            t.nodes.push(new Huffman::Node({(unsigned char) i}, 1));
+            t.pushLeaf(i, 1);
         }
         t.mergeTree();
+        CHECK_EQ(t.node_count, Huffman::Tree::max_nodes);
+        for (int c = 0; c < Huffman::Tree::max_chars; c++)
+            CHECK_EQ(t.code(c).size(), 8);
 
     }
 }
 
 
+TEST_CASE("Tree::computeCodeLengths") {
+    // the lengths cost as many bits as the codes of a merged tree and form a complete code
+    auto check = [](const std::vector<long long>& frequencies) {
+        Huffman::Tree t, merged;
+        for (size_t c = 0; c < frequencies.size(); c++) {
+            t.entries[c] = frequencies[c];
+            if (frequencies[c] != 0)
+                merged.pushLeaf(c, frequencies[c]);
+        }
+        t.computeCodeLengths();
+        merged.mergeTree();
+        long long bits = 0, merged_bits = 0;
+        double kraft = 0;
+        for (size_t c = 0; c < frequencies.size(); c++) {
+            CHECK_EQ(t.lengths[c] == 0, frequencies[c] == 0);
+            bits += frequencies[c] * t.lengths[c];
+            merged_bits += frequencies[c] * merged.lengths[c];
+            if (t.lengths[c] != 0)
+                kraft += 1.0 / (1LL << t.lengths[c]);
+        }
+        CHECK_EQ(bits, merged_bits);
+        CHECK_EQ(kraft, 1.0);
+    };
+    check({5, 0, 7});
+    check(std::vector<long long>(256, 1));
+    check(fibonacci_frequencies(40));
+    unsigned int seed = 7;
+    for (int round = 0; round < 20; round++) {
+        std::vector<long long> random(256);
+        for (auto& f: random)
+            f = (seed = seed * 1103515245 + 12345) >> 16 & (round % 2 ? 0xff : 0xf);
+        check(random);
+    }
+
+    SUBCASE("a single symbol gets one bit") {
+        Huffman::Tree t;
+        t.entries['x'] = 3;
+        t.computeCodeLengths();
+        CHECK_EQ(t.lengths['x'], 1);
+        CHECK_EQ(std::count(t.lengths, t.lengths + Huffman::Tree::max_chars, 0), Huffman::Tree::max_chars - 1);
+    }
+}
+
 TEST_CASE("Tree::buildTree") {
     Huffman::Tree t;
 
@@ -187,7 +387,7 @@ TEST_CASE("Tree::buildTree") {
         std::ifstream in(input);
         t.loadRawEntries(in);
         t.buildTree();
-        CHECK_EQ(t.root, nullptr);
+        CHECK_EQ(t.root, Huffman::no_node);
         CHECK(std::all_of(t.entries, t.entries + t.max_chars, [](int i){ return i == 0; }));
         in.close();
         t.clear();
@@ -197,7 +397,7 @@ TEST_CASE("Tree::buildTree") {
         std::ifstream in(input);
         t.loadEncodedTree(in);
         t.buildTree();
-        CHECK_EQ(t.root, nullptr);
+        CHECK_EQ(t.root, Huffman::no_node);
         CHECK(std::all_of(t.entries, t.entries + t.max_chars, [](int i){ return i == 0; }));
         in.close();
         t.clear();
@@ -211,11 +411,12 @@ TEST_CASE("Tree::buildTree") {
         std::vector<bool> expected_codes[Huffman::Tree::max_chars];
         std::fill(expected_codes, expected_codes + Huffman::Tree::max_chars, std::vector<bool>());
         expected_codes[(unsigned char) 'a'] = {0};
-        expected_codes[(unsigned char) 'b'] = {1, 1, 1};
+        expected_codes[(unsigned char) 'b'] = {1, 0, 0};
         expected_codes[(unsigned char) 'c'] = {1, 0, 1};
         expected_codes[(unsigned char) 'd'] = {1, 1, 0};
-        expected_codes[(unsigned char) 'e'] = {1, 0, 0};
-        CHECK(std::equal(t.codes, t.codes + Huffman::Tree::max_chars, expected_codes));
+        expected_codes[(unsigned char) 'e'] = {1, 1, 1};
+        for (int c = 0; c < Huffman::Tree::max_chars; c++)
+            CHECK(t.code(c) == expected_codes[c]);
         in.close();
         t.clear();
     }
@@ -234,7 +435,8 @@ TEST_CASE("Tree::buildTree") {
         t.buildTree();
         t2.loadRawEntries(in2);
         t2.buildTree();
-        CHECK(std::equal(t.codes, t.codes + Huffman::Tree::max_chars, t2.codes));
+        for (int c = 0; c < Huffman::Tree::max_chars; c++)
+            CHECK(t.code(c) == t2.code(c));
         in1.close();
         in2.close();
         t.clear();
@@ -243,6 +445,26 @@ TEST_CASE("Tree::buildTree") {
     }
 }
 
+TEST_CASE("Tree::limitCodeLengths") {
+    Huffman::Tree t;
+    std::vector<long long> fibonacci = fibonacci_frequencies(40);
+    std::copy(fibonacci.begin(), fibonacci.end(), t.entries);
+    for (int limit: {Huffman::Tree::min_code_length_limit, Huffman::Tree::default_max_code_length}) {
+        CAPTURE(limit);
+        t.max_code_length = limit;
+        t.buildTree();
+        double kraft = 0;
+        for (int c = 0; c < Huffman::Tree::max_chars; c++) {
+            CHECK(t.lengths[c] <= limit);
+            CHECK_EQ(t.code(c).size(), t.lengths[c]);
+            if (t.lengths[c] != 0)
+                kraft += 1.0 / (1LL << t.lengths[c]);
+        }
+        CHECK_EQ(kraft, 1.0);
+        CHECK_EQ(*std::max_element(t.lengths, t.lengths + Huffman::Tree::max_chars), limit);
+    }
+}
+
 TEST_CASE("Tree::input_size, Tree::output_size") {
     SUBCASE("Size 0 expected on empty files") {
         std::string input = resource_path("empty.txt");
@@ -297,6 +519,1022 @@ TEST_CASE("Tree::encodeFile + Tree::decodeFile. Check contents are the same befo
         std::string input = resource_path("many-a.txt");
         encode_decode_compare(input);
     }
+    SUBCASE("english letters and numbers") {
+        std::string input = resource_path("a-z0-9.txt");
+        encode_decode_compare(input);
+    }
+    SUBCASE("single letter") {
+        std::string input = resource_path("a.txt");
+        encode_decode_compare(input);
+    }
+    SUBCASE("wiki frequency example") {
+        std::string input = resource_path("wiki-frequency-test.txt");
+        encode_decode_compare(input);
+    }
+    SUBCASE("codes longer than the decode table") {
+        std::string input = resource_path("fibonacci.txt");
+        std::ofstream out(input);
+        out << fibonacci_text(20);
+        out.close();
+        encode_decode_compare(input);
+        remove(input.c_str());
+    }
+}
+
+TEST_CASE("Block mode") {
+    long long block_size = Huffman::Tree::min_block_size;
+    for (int threads: {1, 4}) {
+        CAPTURE(threads);
+        for (auto name: {"lorem-ipsum.txt", "russian.txt", "many-a.txt", "small.txt", "empty.txt"})
+            encode_decode_compare(resource_path(name), block_size, threads);
+    }
+
+    SUBCASE("every block has its own table") {
+        std::string input = resource_path("lorem-ipsum.txt");
+        std::string output = resource_path("output.bin");
+        Huffman::Tree t;
+        t.block_size = block_size;
+        t.encodeFile(input, output, false, false);
+        CHECK_EQ(t.format, Huffman::Tree::block_format);
+        CHECK_EQ(t.block_count, (t.input_size + block_size - 1) / block_size);
+        CHECK(t.extra_bytes > t.block_count * 40);
+        remove(output.c_str());
+    }
+    SUBCASE("block index points at every frame") {
+        std::string input = resource_path("lorem-ipsum.txt");
+        std::string output = resource_path("output.bin");
+        std::string decoded = resource_path("decoded.txt");
+        Huffman::Tree t;
+        t.block_size = block_size;
+        t.threads = 3;
+        t.encodeFile(input, output, false, false);
+        auto index = t.block_index;
+        long long encoded_size = t.output_size;
+        t.clear();
+        t.decodeFile(output, decoded, false, false);
+        CHECK_EQ(t.input_size, encoded_size);
+        REQUIRE_EQ(t.block_index.size(), index.size());
+        for (size_t i = 0; i < index.size(); i++) {
+            CHECK_EQ(t.block_index[i].offset, index[i].offset);
+            CHECK_EQ(t.block_index[i].size, i + 1 < index.size() ? block_size : t.count % block_size);
+        }
+        CHECK(files_are_same(input, decoded));
+        remove(output.c_str());
+        remove(decoded.c_str());
+    }
+    SUBCASE("blocks that do not compress are stored") {
+        std::string input = resource_path("a-z0-9.txt");
+        std::string output = resource_path("output.bin");
+        Huffman::Tree t;
+        t.block_size = block_size;
+        t.encodeFile(input, output, false, false);
+        // header with a single index entry, block type and count, then the raw bytes
+        CHECK_EQ(t.output_size, 3 * 8 + 2 * 8 + 1 + 8 + 36);
+        remove(output.c_str());
+        encode_decode_compare(input, block_size);
+    }
+}
+
+TEST_CASE("Memory mapped files") {
+    for (long long block_size: {0LL, (long long) Huffman::Tree::min_block_size}) {
+        CAPTURE(block_size);
+        for (auto name: {"lorem-ipsum.txt", "russian.txt", "many-a.txt", "small.txt", "empty.txt"})
+            encode_decode_compare(resource_path(name), block_size, 2, true);
+    }
+
+    SUBCASE("archives are the same as with streams") {
+        std::string input = resource_path("lorem-ipsum.txt");
+        std::string streamed = resource_path("streamed.bin");
+        std::string mapped = resource_path("mapped.bin");
+        for (long long block_size: {0LL, (long long) Huffman::Tree::min_block_size}) {
+            Huffman::Tree t;
+            t.block_size = block_size;
+            t.encodeFile(input, streamed);
+            t.memory_map = true;
+            t.encodeFile(input, mapped);
+            CHECK(files_are_same(streamed, mapped));
+        }
+        remove(streamed.c_str());
+        remove(mapped.c_str());
+    }
+    SUBCASE("legacy archive") {
+        std::string input = resource_path("legacy-small.bin");
+        std::string decoded = resource_path("decoded.txt");
+        Huffman::Tree t;
+        t.memory_map = true;
+        t.decodeFile(input, decoded);
+        CHECK(files_are_same(resource_path("small.txt"), decoded));
+        remove(decoded.c_str());
+    }
+}
+
+TEST_CASE("Interleaved streams") {
+    for (int streams: {2, 4, 8}) {
+        CAPTURE(streams);
+        for (long long block_size: {0LL, (long long) Huffman::Tree::min_block_size}) {
+            CAPTURE(block_size);
+            for (auto name: {"lorem-ipsum.txt", "russian.txt", "many-a.txt", "small.txt", "empty.txt"})
+                encode_decode_compare(resource_path(name), block_size, 2, false, streams);
+        }
+        encode_decode_compare(resource_path("lorem-ipsum.txt"), 0, 1, true, streams);
+    }
+
+    SUBCASE("symbol i goes to substream i % streams") {
+        std::string text = "abacabadabacabae";
+        Huffman::Tree t;
+        t.countEntries((const unsigned char *) text.data(), text.size());
+        t.buildTree();
+        t.buildDecodeTable();
+        t.stream_count = 4;
+        std::vector<char> coded;
+        Huffman::BitWriter writer(coded);
+        long long bits = t.encodeInterleaved((const unsigned char *) text.data(), text.size(), writer);
+        writer.flush();
+        // code lengths a=1, b=2, c=3, d=4, e=4: substreams 0 and 2 hold aaaa, 1 holds bbbb, 3 holds cdce
+        CHECK_EQ(t.substreams[0].size(), 1);
+        CHECK_EQ(t.substreams[1].size(), 1);
+        CHECK_EQ(t.substreams[2].size(), 1);
+        CHECK_EQ(t.substreams[3].size(), 2);
+        CHECK_EQ(bits, 5 * 8);
+        CHECK_EQ(coded.size(), 4 * sizeof(unsigned int) + 5);
+
+        std::vector<unsigned char> decoded(text.size());
+        Huffman::BitReader reader(coded.data(), coded.size());
+        t.decodeInterleaved(reader, decoded.data(), decoded.size());
+        CHECK(std::string(decoded.begin(), decoded.end()) == text);
+    }
+    SUBCASE("archive header") {
+        std::string input = resource_path("lorem-ipsum.txt");
+        std::string output = resource_path("output.bin");
+        Huffman::Tree t;
+        t.streams = 4;
+        t.encodeFile(input, output, false, false);
+        CHECK_EQ(t.format, Huffman::Tree::interleaved_format);
+        long long groups = (t.input_size + Huffman::Tree::interleaved_chunk_size - 1) / Huffman::Tree::interleaved_chunk_size;
+        CHECK_EQ(t.extra_bytes, 8 + 8 + 2 + 2 * (256 - std::count(t.lengths, t.lengths + 256, 0)) + 1 + groups * 4 * 4);
+        t.clear();
+        t.streams = 1;
+        std::string decoded = resource_path("decoded.txt");
+        t.decodeFile(output, decoded, false, false);
+        CHECK_EQ(t.stream_count, 4);
+        CHECK(files_are_same(input, decoded));
+        remove(output.c_str());
+        remove(decoded.c_str());
+    }
+}
+
+TEST_CASE("Stream mode") {
+    long long block_size = Huffman::Tree::min_block_size;
+    for (int threads: {1, 3}) {
+        CAPTURE(threads);
+        for (auto name: {"lorem-ipsum.txt", "russian.txt", "many-a.txt", "a-z0-9.txt", "empty.txt"}) {
+            CAPTURE(name);
+            std::string text = read_file(resource_path(name));
+            std::stringstream input(text), archive, output;
+            Huffman::Tree t;
+            t.block_size = block_size;
+            t.threads = threads;
+            t.format = Huffman::Tree::stream_format;
+            t.encodeStream(input, archive);
+            CHECK_EQ(t.input_size, text.size());
+            CHECK_EQ(t.output_size, archive.str().size());
+            t.clear();
+            t.threads = threads;
+            t.loadEncodedTree(archive);
+            REQUIRE_EQ(t.format, Huffman::Tree::stream_format);
+            t.decodeStream(archive, output);
+            CHECK_EQ(t.output_size, text.size());
+            CHECK(output.str() == text);
+        }
+    }
+
+    SUBCASE("empty input is only the tag and the end frame") {
+        std::stringstream input, archive;
+        Huffman::Tree t;
+        t.format = Huffman::Tree::stream_format;
+        t.encodeStream(input, archive);
+        CHECK_EQ(archive.str().size(), 3 * sizeof(long long));
+        CHECK_EQ(t.extra_bytes, 3 * sizeof(long long));
+    }
+    SUBCASE("archive without the end frame") {
+        std::stringstream input(read_file(resource_path("lorem-ipsum.txt"))), archive;
+        Huffman::Tree t;
+        t.format = Huffman::Tree::stream_format;
+        t.encodeStream(input, archive);
+        std::string bytes = archive.str();
+        std::stringstream truncated(bytes.substr(0, bytes.size() - 2 * sizeof(long long)));
+        std::stringstream output;
+        t.clear();
+        t.loadEncodedTree(truncated);
+        CHECK_THROWS_AS(t.decodeStream(truncated, output), std::invalid_argument);
+    }
+}
+
+// Reads a string through a buffer that cannot seek, like a pipe
+class PipeBuffer : public std::streambuf {
+public:
+    explicit PipeBuffer(const std::string& text) : text(text) {
+        setg(&this->text[0], &this->text[0], &this->text[0] + this->text.size());
+    }
+
+private:
+    std::string text;
+};
+
+// Collects what is written and, like a pipe, cannot seek back to it
+class PipeSink : public std::streambuf {
+public:
+    std::string text;
+
+protected:
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        text.append(s, n);
+        return n;
+    }
+
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            text += traits_type::to_char_type(c);
+        return traits_type::not_eof(c);
+    }
+};
+
+TEST_CASE("Non-seekable input") {
+    std::string text = read_file(resource_path("lorem-ipsum.txt"));
+    PipeBuffer pipe(text);
+    std::istream in(&pipe);
+    REQUIRE(in.tellg() < 0);
+    std::stringstream archive;
+    Huffman::Tree t;
+
+    SUBCASE("a single table falls back to a stream archive") {
+        t.encodeArchive(in, archive);
+        CHECK_EQ(t.format, Huffman::Tree::stream_format);
+        std::string bytes = archive.str();
+        std::vector<char> decoded;
+        Huffman::Tree u;
+        u.decodeBuffer(bytes.data(), bytes.size(), decoded);
+        CHECK(std::string(decoded.begin(), decoded.end()) == text);
+    }
+    SUBCASE("block mode falls back to a stream archive") {
+        t.block_size = Huffman::Tree::min_block_size;
+        t.encodeArchive(in, archive);
+        CHECK_EQ(t.format, Huffman::Tree::stream_format);
+        std::string bytes = archive.str();
+        std::vector<char> decoded;
+        Huffman::Tree u;
+        u.decodeBuffer(bytes.data(), bytes.size(), decoded);
+        CHECK(std::string(decoded.begin(), decoded.end()) == text);
+    }
+    SUBCASE("trained tables read it into memory") {
+        std::string table_file = resource_path("pipe.tbl");
+        std::vector<std::string> samples = {resource_path("lorem-ipsum.txt")};
+        t.trainTable(samples, table_file);
+        t.table_file = table_file;
+        t.encodeArchive(in, archive);
+        CHECK_EQ(t.format, Huffman::Tree::trained_format);
+        std::string bytes = archive.str();
+        std::vector<char> decoded;
+        Huffman::Tree u;
+        u.table_file = table_file;
+        u.decodeBuffer(bytes.data(), bytes.size(), decoded);
+        CHECK(std::string(decoded.begin(), decoded.end()) == text);
+        remove(table_file.c_str());
+    }
+    SUBCASE("context mode needs to seek") {
+        t.context = true;
+        CHECK_THROWS_WITH_AS(t.encodeArchive(in, archive), "Context mode needs a seekable input",
+                             std::invalid_argument);
+    }
+}
+
+TEST_CASE("Non-seekable output") {
+    std::string text = read_file(resource_path("lorem-ipsum.txt"));
+    std::istringstream in(text);
+    PipeSink pipe;
+    std::ostream out(&pipe);
+    REQUIRE(out.tellp() < 0);
+    Huffman::Tree t;
+    // the block index is written last, an output that cannot seek back to it gets a stream archive
+    t.block_size = Huffman::Tree::min_block_size;
+    t.encodeArchive(in, out);
+    CHECK_EQ(t.format, Huffman::Tree::stream_format);
+    std::vector<char> decoded;
+    Huffman::Tree u;
+    u.decodeBuffer(pipe.text.data(), pipe.text.size(), decoded);
+    CHECK(std::string(decoded.begin(), decoded.end()) == text);
+}
+
+TEST_CASE("Range decoding") {
+    std::string input = resource_path("lorem-ipsum.txt");
+    std::string encoded = resource_path("encoded.bin");
+    std::string decoded = resource_path("decoded.txt");
+    std::string text = read_file(input);
+    long long block_size = Huffman::Tree::min_block_size;
+    std::vector<std::pair<long long, long long>> ranges = {
+            {0, -1}, {0, 10}, {100, 1}, {block_size - 5, 10}, {3 * block_size, block_size},
+            {(long long) text.size() - 7, -1}, {(long long) text.size() - 7, 100}, {(long long) text.size() + 3, 5},
+            {500, 0}};
+
+    auto check_ranges = [&](std::string archive) {
+        for (auto range: ranges) {
+            CAPTURE(range.first);
+            CAPTURE(range.second);
+            Huffman::Tree t;
+            t.threads = 2;
+            t.range_offset = range.first;
+            t.range_length = range.second;
+            t.decodeFile(archive, decoded);
+            std::string expected = range.first >= (long long) text.size() ? "" : text.substr(range.first,
+                    range.second < 0 ? std::string::npos : range.second);
+            CHECK(read_file(decoded) == expected);
+        }
+    };
+    SUBCASE("block archive") {
+        Huffman::Tree t;
+        t.block_size = block_size;
+        t.encodeFile(input, encoded);
+        check_ranges(encoded);
+
+        // only the frames of the two blocks around the middle are read
+        long long middle = text.size() / 2 / block_size;
+        t.range_offset = (middle + 1) * block_size - 10;
+        t.range_length = 20;
+        t.decodeFile(encoded, decoded, false, false);
+        CHECK_EQ(t.output_size, 20);
+        long long header_bytes = 3 * sizeof(long long) + t.block_count * sizeof(Huffman::BlockIndexEntry);
+        CHECK_EQ(t.input_size, header_bytes + t.block_index[middle + 2].offset - t.block_index[middle].offset);
+    }
+    SUBCASE("stream archive") {
+        std::ifstream in(input);
+        std::ofstream out(encoded);
+        Huffman::Tree t;
+        t.block_size = block_size;
+        t.format = Huffman::Tree::stream_format;
+        t.encodeStream(in, out);
+        out.close();
+        check_ranges(encoded);
+    }
+    SUBCASE("single table archives") {
+        for (int streams: {1, 4}) {
+            Huffman::Tree t;
+            t.streams = streams;
+            t.encodeFile(input, encoded);
+            check_ranges(encoded);
+        }
+    }
+    SUBCASE("adaptive archive") {
+        Huffman::Tree t;
+        t.adaptive = true;
+        t.encodeFile(input, encoded);
+        check_ranges(encoded);
+    }
+    SUBCASE("context archive") {
+        Huffman::Tree t;
+        t.context = true;
+        t.encodeFile(input, encoded);
+        check_ranges(encoded);
+    }
+    SUBCASE("invalid range") {
+        Huffman::Tree t;
+        t.encodeFile(input, encoded);
+        t.range_offset = -1;
+        CHECK_THROWS_WITH_AS(t.decodeFile(encoded, decoded), "Invalid range", std::invalid_argument);
+    }
+    remove(encoded.c_str());
+    remove(decoded.c_str());
+}
+
+TEST_CASE("Buffer API") {
+    std::vector<std::string> texts;
+    for (auto name: {"lorem-ipsum.txt", "russian.txt", "many-a.txt", "a-z0-9.txt", "small.txt", "empty.txt"})
+        texts.push_back(read_file(resource_path(name)));
+    texts.push_back(random_text(3 * Huffman::Tree::min_block_size + 17, 1));
+
+    for (long long block_size: {0LL, (long long) Huffman::Tree::min_block_size}) {
+        for (int streams: {1, 4}) {
+            CAPTURE(block_size);
+            CAPTURE(streams);
+            Huffman::Tree t;
+            t.block_size = block_size;
+            t.streams = streams;
+            t.threads = 2;
+            std::vector<char> archive, decoded;
+            for (auto &text: texts) {
+                size_t archive_size = t.encodeBuffer(text.data(), text.size(), archive);
+                CHECK_EQ(archive_size, archive.size());
+                CHECK(archive_size <= t.maxEncodedSize(text.size()));
+                CHECK_EQ(t.decodedSize(archive.data(), archive.size()), text.size());
+                CHECK_EQ(t.decodeBuffer(archive.data(), archive.size(), decoded), text.size());
+                CHECK(std::string(decoded.begin(), decoded.end()) == text);
+
+                // fixed buffers sized by the bounds, the archive is the same as in a vector
+                std::vector<char> fixed_archive(t.maxEncodedSize(text.size())), fixed_text(text.size());
+                CHECK_EQ(t.encodeBuffer(text.data(), text.size(), fixed_archive.data(), fixed_archive.size()),
+                         archive_size);
+                CHECK(std::equal(archive.begin(), archive.end(), fixed_archive.begin()));
+                CHECK_EQ(t.decodeBuffer(archive.data(), archive.size(), fixed_text.data(), fixed_text.size()),
+                         text.size());
+                CHECK(std::string(fixed_text.begin(), fixed_text.end()) == text);
+            }
+        }
+    }
+
+    SUBCASE("files after buffers") {
+        // the buffer calls leave their state in the tree, the file calls must not pick it up
+        std::string input = resource_path("lorem-ipsum.txt");
+        std::string encoded = resource_path("encoded.bin");
+        std::string actual = resource_path("actual.txt");
+        Huffman::Tree t;
+        std::vector<char> archive, decoded;
+        t.encodeBuffer(texts[4].data(), texts[4].size(), archive);
+        t.encodeFile(input, encoded, false, false);
+        t.decodeBuffer(archive.data(), archive.size(), decoded);
+        t.decodeFile(encoded, actual, false, false);
+        CHECK(files_are_same(input, actual));
+        remove(encoded.c_str());
+        remove(actual.c_str());
+    }
+    SUBCASE("same archive as a file") {
+        std::string input = resource_path("lorem-ipsum.txt");
+        std::string encoded = resource_path("encoded.bin");
+        Huffman::Tree t;
+        t.block_size = Huffman::Tree::min_block_size;
+        t.encodeFile(input, encoded);
+        std::vector<char> archive;
+        t.encodeBuffer(texts[0].data(), texts[0].size(), archive);
+        CHECK(read_file(encoded) == std::string(archive.begin(), archive.end()));
+        remove(encoded.c_str());
+    }
+    SUBCASE("ranges") {
+        Huffman::Tree t;
+        t.block_size = Huffman::Tree::min_block_size;
+        std::vector<char> archive, decoded;
+        t.encodeBuffer(texts[0].data(), texts[0].size(), archive);
+        t.range_offset = 5000;
+        t.range_length = 3000;
+        char slice[3000];
+        CHECK_EQ(t.decodeBuffer(archive.data(), archive.size(), slice, sizeof(slice)), sizeof(slice));
+        CHECK(std::string(slice, sizeof(slice)) == texts[0].substr(5000, 3000));
+        CHECK_EQ(t.decodeBuffer(archive.data(), archive.size(), decoded), sizeof(slice));
+        CHECK(std::string(decoded.begin(), decoded.end()) == texts[0].substr(5000, 3000));
+    }
+    SUBCASE("buffers that are too small") {
+        Huffman::Tree t;
+        std::vector<char> archive;
+        t.encodeBuffer(texts[0].data(), texts[0].size(), archive);
+        std::vector<char> small(archive.size() - 1);
+        CHECK_THROWS_WITH_AS(t.encodeBuffer(texts[0].data(), texts[0].size(), small.data(), small.size()),
+                             "Output buffer is too small", std::invalid_argument);
+        small.resize(texts[0].size() - 1);
+        CHECK_THROWS_WITH_AS(t.decodeBuffer(archive.data(), archive.size(), small.data(), small.size()),
+                             "Output buffer is too small", std::invalid_argument);
+    }
+    SUBCASE("invalid archive") {
+        Huffman::Tree t;
+        std::vector<char> decoded;
+        std::string garbage = "\xfb\xff\xff\xff\xff\xff\xff\xff";
+        CHECK_THROWS_AS(t.decodeBuffer(garbage.data(), garbage.size(), decoded), std::invalid_argument);
+    }
+}
+
+TEST_CASE("Pair coding") {
+    // the pair table writes the same bits as the single-symbol table
+    auto same_bits = [](Huffman::Tree& t, const std::string& text) {
+        std::vector<char> single, pairs;
+        t.pair_coding = false;
+        {
+            Huffman::BitWriter writer(single);
+            t.encodeSymbols((const unsigned char*) text.data(), text.size(), writer);
+            writer.flush();
+        }
+        t.buildPairTable();
+        t.pair_coding = true;
+        {
+            Huffman::BitWriter writer(pairs);
+            t.encodeSymbols((const unsigned char*) text.data(), text.size(), writer);
+            writer.flush();
+        }
+        CHECK(single == pairs);
+    };
+    std::string lorem = read_file(resource_path("lorem-ipsum.txt"));
+    REQUIRE(!lorem.empty());
+    std::string text;
+    while ((long long) text.size() < Huffman::Tree::min_pair_coding_bytes)
+        text += lorem;
+    text += "z";
+
+    SUBCASE("chosen for long inputs with short codes") {
+        Huffman::Tree t;
+        std::vector<char> archive, decoded;
+        t.encodeBuffer(text.data(), text.size(), archive);
+        CHECK(t.pair_coding);
+        t.decodeBuffer(archive.data(), archive.size(), decoded);
+        CHECK(std::string(decoded.begin(), decoded.end()) == text);
+        same_bits(t, text);
+
+        t.encodeBuffer(lorem.data(), lorem.size(), archive);
+        CHECK_FALSE(t.pair_coding);
+    }
+    SUBCASE("not chosen for random bytes") {
+        std::string random = random_text(text.size(), 1);
+        Huffman::Tree t;
+        std::vector<char> archive;
+        t.encodeBuffer(random.data(), random.size(), archive);
+        CHECK_FALSE(t.pair_coding);
+        same_bits(t, random);
+    }
+    SUBCASE("pairs longer than an entry") {
+        std::string fibonacci = fibonacci_text(24);
+        Huffman::Tree t;
+        t.max_code_length = Huffman::Tree::max_code_length_limit;
+        t.countEntries((const unsigned char*) fibonacci.data(), fibonacci.size());
+        t.buildTree();
+        CHECK(*std::max_element(t.lengths, t.lengths + Huffman::Tree::max_chars) > Huffman::Tree::max_pair_bits / 2);
+        same_bits(t, fibonacci);
+    }
+    SUBCASE("block mode") {
+        Huffman::Tree t;
+        t.block_size = Huffman::Tree::min_pair_coding_bytes;
+        std::vector<char> archive, decoded;
+        t.encodeBuffer(text.data(), text.size(), archive);
+        t.decodeBuffer(archive.data(), archive.size(), decoded);
+        CHECK(std::string(decoded.begin(), decoded.end()) == text);
+    }
+}
+
+TEST_CASE("Multi-symbol decoding") {
+    std::vector<std::string> texts;
+    for (auto name: {"lorem-ipsum.txt", "russian.txt", "many-a.txt", "a-z0-9.txt", "a.txt", "small.txt",
+                     "wiki-frequency-test.txt", "empty.txt"})
+        texts.push_back(read_file(resource_path(name)));
+    texts.push_back(fibonacci_text(20));
+
+    SUBCASE("same bytes as the single-symbol table") {
+        for (auto &text: texts) {
+            Huffman::Tree t;
+            t.countEntries((const unsigned char*) text.data(), text.size());
+            t.buildTree();
+            t.buildDecodeTable();
+            t.buildMultiDecodeTable();
+            std::vector<char> coded;
+            {
+                Huffman::BitWriter writer(coded);
+                t.encodeSymbols((const unsigned char*) text.data(), text.size(), writer);
+                writer.flush();
+            }
+            for (bool multi: {false, true}) {
+                CAPTURE(multi);
+                t.multi_decoding = multi;
+                std::string decoded(text.size(), 0);
+                Huffman::BitReader reader(coded.data(), coded.size());
+                t.decodeSymbols(reader, (unsigned char*) &decoded[0], decoded.size());
+                CHECK(decoded == text);
+            }
+        }
+    }
+    SUBCASE("chosen for short codes") {
+        Huffman::Tree t;
+        std::vector<char> archive, decoded;
+        t.encodeBuffer(texts[2].data(), texts[2].size(), archive);
+        t.decodeBuffer(archive.data(), archive.size(), decoded);
+        CHECK(t.multi_decoding);
+        CHECK(std::string(decoded.begin(), decoded.end()) == texts[2]);
+
+        std::string random = random_text(Huffman::Tree::min_multi_decoding_bytes, 1);
+        t.encodeBuffer(random.data(), random.size(), archive);
+        t.decodeBuffer(archive.data(), archive.size(), decoded);
+        CHECK_FALSE(t.multi_decoding);
+    }
+    SUBCASE("files and blocks") {
+        std::string input = resource_path("many-a.txt");
+        encode_decode_compare(input);
+        encode_decode_compare(input, Huffman::Tree::min_multi_decoding_bytes);
+    }
+    SUBCASE("truncated archive") {
+        // two bits a byte, so that the cut archive still has room for its count
+        std::string text;
+        while (text.size() < Huffman::Tree::min_multi_decoding_bytes)
+            text += "abcd";
+        Huffman::Tree t;
+        std::vector<char> archive, decoded;
+        t.encodeBuffer(text.data(), text.size(), archive);
+        t.decodeBuffer(archive.data(), archive.size(), decoded);
+        REQUIRE(t.multi_decoding);
+        archive.resize(archive.size() - 100);
+        CHECK_THROWS_WITH_AS(t.decodeBuffer(archive.data(), archive.size(), decoded), "Unable to read expected bits",
+                             std::invalid_argument);
+    }
+}
+
+TEST_CASE("Tree reuse does not allocate") {
+    std::string input = resource_path("lorem-ipsum.txt");
+    std::string encoded = resource_path("reuse.bin");
+    std::string actual = resource_path("reuse.txt");
+    std::string text = read_file(input);
+    std::string shorter = text.substr(0, text.size() / 2);
+    struct Setting {
+        long long block_size;
+        int streams;
+        bool context;
+        bool adaptive;
+    };
+    for (Setting setting: {Setting{0, 1, false, false}, Setting{0, 4, false, false}, Setting{1 << 16, 1, false, false},
+                           Setting{1 << 16, 4, false, false}, Setting{0, 1, true, false}, Setting{0, 1, false, true}}) {
+        CAPTURE(setting.block_size);
+        CAPTURE(setting.streams);
+        CAPTURE(setting.context);
+        CAPTURE(setting.adaptive);
+        Huffman::Tree t;
+        t.block_size = setting.block_size;
+        t.streams = setting.streams;
+        t.context = setting.context;
+        t.adaptive = setting.adaptive;
+        t.threads = 1;
+        std::vector<char> archive, decoded;
+        // the overloads writing into the caller's memory are held to the same
+        std::vector<char> fixed_archive(t.maxEncodedSize(text.size())), fixed_text(text.size());
+        auto buffers = [&](const std::string& data) {
+            t.encodeBuffer(data.data(), data.size(), archive);
+            t.decodeBuffer(archive.data(), archive.size(), decoded);
+            size_t archive_size = t.encodeBuffer(data.data(), data.size(), fixed_archive.data(), fixed_archive.size());
+            CHECK_EQ(t.decodeBuffer(fixed_archive.data(), archive_size, fixed_text.data(), fixed_text.size()),
+                     data.size());
+        };
+        auto files = [&] {
+            t.encodeFile(input, encoded);
+            t.decodeFile(encoded, actual);
+        };
+        // warm-up: the tree and the output vectors grow to what the text needs
+        buffers(text);
+        files();
+
+        long long before = allocation_count;
+        buffers(text);
+        long long allocations = allocation_count - before;
+        CHECK_EQ(allocations, 0);
+        CHECK(std::string(decoded.begin(), decoded.end()) == text);
+
+        before = allocation_count;
+        files();
+        allocations = allocation_count - before;
+        CHECK_EQ(allocations, 0);
+        CHECK(files_are_same(input, actual));
+
+        // a new text reuses the storage of the previous one as long as it fits
+        before = allocation_count;
+        buffers(shorter);
+        allocations = allocation_count - before;
+        CHECK_EQ(allocations, 0);
+        CHECK(std::string(decoded.begin(), decoded.end()) == shorter);
+    }
+    remove(encoded.c_str());
+    remove(actual.c_str());
+}
+
+TEST_CASE("Adaptive mode") {
+    auto adaptive = [](Huffman::Tree& t) { t.adaptive = true; };
+    std::string small = read_file(resource_path("small.txt"));
+    // the archive is the format tag and the bits, without a table, and the end marker tells the size
+    std::vector<size_t> sizes = mode_round_trip(
+            adaptive, {"lorem-ipsum.txt", "russian.txt", "many-a.txt", "a-z0-9.txt", "small.txt", "a.txt", "empty.txt",
+                       "wiki-frequency-test.txt", "legacy-small.bin"},
+            {small, read_file(resource_path("lorem-ipsum.txt")), random_text(20000, 1), std::string()},
+            sizeof(long long), false);
+    // no table to pay for on small inputs
+    CHECK(sizes[0] < single_table_size(small));
+
+    SUBCASE("truncated archive") {
+        std::string text = read_file(resource_path("lorem-ipsum.txt"));
+        Huffman::Tree t;
+        t.adaptive = true;
+        std::vector<char> archive, decoded;
+        t.encodeBuffer(text.data(), text.size(), archive);
+        archive.resize(archive.size() / 2);
+        CHECK_THROWS_AS(t.decodeBuffer(archive.data(), archive.size(), decoded), std::invalid_argument);
+    }
+}
+
+TEST_CASE("Context mode") {
+    auto context = [](Huffman::Tree& t) { t.context = true; };
+    std::vector<std::string> texts = {read_file(resource_path("lorem-ipsum.txt")), read_file(resource_path("russian.txt")),
+                                      random_text(100000, 1)};
+    // random data only has to stay within the bound
+    std::vector<size_t> sizes = mode_round_trip(
+            context, {"lorem-ipsum.txt", "russian.txt", "many-a.txt", "a-z0-9.txt", "small.txt", "a.txt", "empty.txt",
+                      "wiki-frequency-test.txt", "legacy-small.bin"}, texts);
+    // smaller than a single table on text
+    CHECK(sizes[0] < single_table_size(texts[0]));
+    CHECK(sizes[1] < single_table_size(texts[1]));
+
+    SUBCASE("one table per group of contexts") {
+        // after 'a' always 'b', after 'b' always 'a': two single-symbol groups code every byte in 1 bit
+        std::string text;
+        for (int i = 0; i < 5000; i++)
+            text += "ab";
+        Huffman::ContextModel model;
+        model.count((const unsigned char *) text.data(), text.size());
+        model.build(Huffman::Tree::default_max_code_length);
+        CHECK(model.tables.size() <= (size_t) Huffman::ContextModel::max_tables);
+        CHECK_NE(model.context_map['a'], model.context_map['b']);
+        std::vector<char> coded;
+        Huffman::BitWriter writer(coded);
+        CHECK_EQ(model.encode((const unsigned char *) text.data(), text.size(), writer), (long long) text.size());
+    }
+
+    SUBCASE("invalid context header") {
+        std::string text = read_file(resource_path("lorem-ipsum.txt"));
+        Huffman::Tree t;
+        t.context = true;
+        std::vector<char> archive, decoded;
+        t.encodeBuffer(text.data(), text.size(), archive);
+        // the number of tables follows the tag and the count
+        archive[2 * sizeof(long long)] = Huffman::ContextModel::max_tables + 1;
+        CHECK_THROWS_WITH_AS(t.decodeBuffer(archive.data(), archive.size(), decoded), "Header data not found",
+                             std::invalid_argument);
+    }
+
+    SUBCASE("a table without symbols") {
+        // every context maps to the second table, which has nothing to decode with
+        std::vector<char> header;
+        Huffman::BitWriter writer(header);
+        unsigned char table_count = 2, pair = 0x11, symbol = 'a', length = 1;
+        unsigned short symbols = 1, no_symbols = 0;
+        long long count = 4, empty = 0;
+        writer << table_count;
+        for (int i = 0; i < Huffman::ContextModel::map_bytes; i++)
+            writer << pair;
+        writer << count << symbols << symbol << length << empty << no_symbols;
+        writer.flush();
+        Huffman::BitReader reader(header.data(), header.size());
+        Huffman::ContextModel model;
+        CHECK_THROWS_WITH_AS(model.readHeader(reader, count), "Header data not found", std::invalid_argument);
+    }
+}
+
+TEST_CASE("Trained tables") {
+    std::string table = resource_path("trained.tbl");
+    std::string encoded = resource_path("encoded.bin");
+    std::string actual = resource_path("actual.txt");
+    Huffman::Tree trainer;
+    trainer.trainTable({resource_path("lorem-ipsum.txt"), resource_path("small.txt")}, table);
+
+    // bytes missing from the samples, such as the Cyrillic ones, still have codes
+    auto trained = [&table](Huffman::Tree& t) { t.table_file = table; };
+    std::string small = read_file(resource_path("small.txt"));
+    std::vector<size_t> sizes = mode_round_trip(
+            trained, {"lorem-ipsum.txt", "russian.txt", "small.txt", "a.txt", "empty.txt", "legacy-small.bin"}, {small},
+            3 * sizeof(long long));
+    // small payloads pay no table
+    CHECK(sizes[0] < single_table_size(small));
+
+    SUBCASE("training is deterministic") {
+        std::string again = resource_path("trained-again.tbl");
+        Huffman::Tree t;
+        t.trainTable({resource_path("lorem-ipsum.txt"), resource_path("small.txt")}, again);
+        CHECK(files_are_same(table, again));
+        remove(again.c_str());
+    }
+
+    SUBCASE("table length limit") {
+        Huffman::Tree t;
+        t.max_code_length = Huffman::Tree::min_code_length_limit;
+        t.trainTable({resource_path("lorem-ipsum.txt")}, table);
+        t.table_file = table;
+        t.loadTrainedTable();
+        int longest = *std::max_element(t.trained_lengths, t.trained_lengths + Huffman::Tree::max_chars);
+        CHECK_EQ(longest, t.max_code_length);
+    }
+
+    SUBCASE("missing or different table") {
+        std::string input = resource_path("small.txt");
+        Huffman::Tree t;
+        t.table_file = table;
+        t.encodeFile(input, encoded);
+        Huffman::Tree u;
+        CHECK_THROWS_WITH_AS(u.decodeFile(encoded, actual), "Archive needs a trained table", std::invalid_argument);
+        std::string other = resource_path("other.tbl");
+        u.trainTable({resource_path("russian.txt")}, other);
+        u.table_file = other;
+        CHECK_THROWS_WITH_AS(u.decodeFile(encoded, actual), "Trained table does not match the archive",
+                             std::invalid_argument);
+        u.table_file = resource_path("does-not-exist.tbl");
+        CHECK_THROWS_WITH_AS(u.decodeFile(encoded, actual), "Unable to open table file", std::invalid_argument);
+        // an archive is not a table
+        u.table_file = encoded;
+        CHECK_THROWS_WITH_AS(u.encodeFile(input, actual), "Invalid trained table", std::invalid_argument);
+        remove(other.c_str());
+    }
+    remove(table.c_str());
+    remove(encoded.c_str());
+    remove(actual.c_str());
+}
+
+TEST_CASE("Benchmark") {
+    Huffman::Benchmark benchmark(resource_path("lorem-ipsum.txt"));
+    Huffman::Tree t;
+    t.block_size = Huffman::Tree::min_block_size;
+    Huffman::BenchmarkResult result = benchmark.run(t, 3);
+    CHECK_EQ(result.iterations, 3);
+    CHECK_EQ(result.input_bytes, read_file(resource_path("lorem-ipsum.txt")).size());
+    std::vector<char> archive;
+    std::string text = read_file(resource_path("lorem-ipsum.txt"));
+    CHECK_EQ(result.archive_bytes, t.encodeBuffer(text.data(), text.size(), archive));
+    for (auto &speed: {result.compress, result.decompress}) {
+        CHECK(speed.mean > 0);
+        CHECK(speed.best >= speed.mean);
+        CHECK(speed.deviation >= 0);
+    }
+    std::ostringstream line;
+    Huffman::Benchmark::print(line, t, result);
+    CHECK(line.str().find("block-size 1024 ") == 0);
+    CHECK(line.str().find(" iterations 3 ") != std::string::npos);
+
+    CHECK_THROWS_WITH_AS(benchmark.run(t, 0), "Invalid iteration count", std::invalid_argument);
+    CHECK_THROWS_WITH_AS(Huffman::Benchmark(resource_path("does-not-exist")), "Unable to open input file",
+                         std::invalid_argument);
+}
+
+TEST_CASE("Statistics") {
+    std::string input = resource_path("lorem-ipsum.txt");
+    std::string encoded = resource_path("encoded.bin");
+    std::string decoded = resource_path("decoded.txt");
+    long long size = read_file(input).size();
+    for (long long block_size: {0LL, (long long) Huffman::Tree::min_block_size}) {
+        CAPTURE(block_size);
+        Huffman::Tree t;
+        t.block_size = block_size;
+        t.threads = 2;
+        t.encodeFile(input, encoded);
+        const Huffman::Statistics &encoding = t.statistics;
+        CHECK_EQ(encoding.input_bytes, size);
+        CHECK_EQ(encoding.output_bytes, (long long) read_file(encoded).size());
+        CHECK_EQ(encoding.data_bytes, size);
+        CHECK(encoding.header_bytes > 0);
+        // Huffman codes are less than a bit per byte longer than the entropy
+        CHECK(encoding.entropy > 0);
+        CHECK(encoding.entropy <= encoding.code_length);
+        CHECK(encoding.code_length < encoding.entropy + 1);
+        CHECK(encoding.histogram.cpu >= 0);
+        CHECK(encoding.coding.wall > 0);
+        CHECK(encoding.total.wall >= encoding.io.wall);
+        double code_length = encoding.code_length;
+
+        t.decodeFile(encoded, decoded);
+        const Huffman::Statistics &decoding = t.statistics;
+        CHECK_EQ(decoding.input_bytes, (long long) read_file(encoded).size());
+        CHECK_EQ(decoding.output_bytes, size);
+        CHECK_EQ(decoding.code_length, doctest::Approx(code_length));
+        // the decoder has the code lengths, not the histogram
+        CHECK_EQ(decoding.entropy, -1);
+        CHECK(decoding.coding.wall > 0);
+    }
+
+    SUBCASE("formats") {
+        Huffman::Tree t;
+        std::vector<char> archive;
+        std::string text = read_file(input);
+        t.encodeBuffer(text.data(), text.size(), archive);
+        std::ostringstream json, key_value;
+        t.statistics.write(json, Huffman::StatisticsFormat::json);
+        CHECK(json.str().find("{\"input_bytes\": " + std::to_string(size) + ", ") == 0);
+        CHECK(json.str().find("\"coding\": {\"wall\": ") != std::string::npos);
+        t.statistics.write(key_value, Huffman::StatisticsFormat::key_value);
+        CHECK(key_value.str().find("input_bytes=" + std::to_string(size) + "\n") == 0);
+        CHECK(key_value.str().find("\ntotal_cpu=") != std::string::npos);
+    }
+
+    SUBCASE("format names") {
+        CHECK(Huffman::parseStatisticsFormat("json") == Huffman::StatisticsFormat::json);
+        CHECK(Huffman::parseStatisticsFormat("kv") == Huffman::StatisticsFormat::key_value);
+        CHECK_THROWS_WITH_AS(Huffman::parseStatisticsFormat("xml"), "Invalid statistics format", std::invalid_argument);
+    }
+
+    SUBCASE("printed on request") {
+        std::ostringstream printed;
+        std::streambuf *standard_output = std::cout.rdbuf(printed.rdbuf());
+        Huffman::Tree t;
+        t.statistics_format = Huffman::StatisticsFormat::key_value;
+        t.encodeFile(input, encoded, true);
+        t.statistics_format = Huffman::StatisticsFormat::sizes;
+        t.encodeFile(input, encoded, true);
+        std::cout.rdbuf(standard_output);
+        CHECK(printed.str().find("input_bytes=" + std::to_string(size) + "\n") == 0);
+        CHECK(printed.str().find("\n" + std::to_string(size) + "\n") != std::string::npos);
+    }
+    remove(encoded.c_str());
+    remove(decoded.c_str());
+}
+
+TEST_CASE("Incremental encoder and decoder") {
+    std::string text = read_file(resource_path("lorem-ipsum.txt"));
+    long long block_size = Huffman::Tree::min_block_size;
+    unsigned int seed = 7;
+    auto next_chunk = [&seed](size_t limit) {
+        seed = seed * 1103515245 + 12345;
+        return std::min<size_t>(limit, (seed >> 16) % 3000);
+    };
+
+    SUBCASE("pieces of any size make the same archive as Tree") {
+        Huffman::Encoder encoder;
+        encoder.block_size = block_size;
+        std::vector<char> archive;
+        for (size_t done = 0; done < text.size();) {
+            size_t size = next_chunk(text.size() - done);
+            encoder.update(text.data() + done, size, archive);
+            done += size;
+            CHECK(archive.size() < sizeof(long long) + done);
+        }
+        encoder.finish(archive);
+        CHECK_THROWS_WITH_AS(encoder.update(text.data(), 1, archive), "Encoder is finished", std::invalid_argument);
+
+        std::stringstream input(text), expected;
+        Huffman::Tree t;
+        t.block_size = block_size;
+        t.format = Huffman::Tree::stream_format;
+        t.encodeStream(input, expected);
+        CHECK(expected.str() == std::string(archive.begin(), archive.end()));
+    }
+    SUBCASE("flushed data can be decoded right away") {
+        Huffman::Encoder encoder;
+        encoder.block_size = block_size;
+        encoder.streams = 4;
+        Huffman::Decoder decoder;
+        std::vector<char> archive;
+        std::string decoded;
+        char buffer[700];
+        size_t fed = 0;
+        for (size_t done = 0; done < text.size();) {
+            size_t size = next_chunk(text.size() - done);
+            encoder.update(text.data() + done, size, archive);
+            encoder.flush(archive);
+            done += size;
+            decoder.update(archive.data() + fed, archive.size() - fed);
+            fed = archive.size();
+            while (size_t n = decoder.read(buffer, sizeof(buffer)))
+                decoded.append(buffer, n);
+            CHECK_EQ(decoded.size(), done);
+        }
+        encoder.finish(archive);
+        decoder.update(archive.data() + fed, archive.size() - fed);
+        CHECK_EQ(decoder.read(buffer, sizeof(buffer)), 0);
+        CHECK(decoder.finished());
+        CHECK(decoded == text);
+    }
+    SUBCASE("archive arriving in small pieces") {
+        std::vector<char> archive;
+        Huffman::Tree t;
+        t.block_size = block_size;
+        t.format = Huffman::Tree::stream_format;
+        std::stringstream input(text), output;
+        t.encodeStream(input, output);
+        std::string bytes = output.str();
+
+        Huffman::Decoder decoder;
+        std::string decoded;
+        char buffer[1 << 12];
+        for (size_t done = 0; done < bytes.size();) {
+            size_t size = std::max<size_t>(1, next_chunk(bytes.size() - done) / 10);
+            decoder.update(bytes.data() + done, size);
+            done += size;
+            CHECK_FALSE(decoder.finished());
+            while (size_t n = decoder.read(buffer, sizeof(buffer)))
+                decoded.append(buffer, n);
+        }
+        CHECK(decoder.finished());
+        CHECK(decoded == text);
+    }
+    SUBCASE("only stream archives") {
+        std::vector<char> archive;
+        Huffman::Tree t;
+        t.encodeBuffer(text.data(), text.size(), archive);
+        Huffman::Decoder decoder;
+        decoder.update(archive.data(), archive.size());
+        char buffer[16];
+        CHECK_THROWS_WITH_AS(decoder.read(buffer, sizeof(buffer)), "Header data not found", std::invalid_argument);
+    }
+}
+
+TEST_CASE("Archive formats") {
+    SUBCASE("legacy frequency header is still decoded") {
+        std::string input = resource_path("legacy-small.bin");
+        std::string decoded = resource_path("decoded.txt");
+        Huffman::Tree t;
+        t.decodeFile(input, decoded, false, false);
+        CHECK_EQ(t.format, Huffman::Tree::legacy_format);
+        CHECK_EQ(t.extra_bytes, Huffman::Tree::legacy_header_bytes);
+        CHECK(files_are_same(resource_path("small.txt"), decoded));
+        remove(decoded.c_str());
+    }
+    SUBCASE("canonical header stores only code lengths") {
+        std::string input = resource_path("wiki-frequency-test.txt");
+        std::string output = resource_path("output.bin");
+        Huffman::Tree t;
+        t.encodeFile(input, output, false, false);
+        // tag, count, number of symbols and a (symbol, length) pair for each of 5 symbols
+        CHECK_EQ(t.extra_bytes, 8 + 8 + 2 + 5 * 2);
+        remove(output.c_str());
+    }
 }
 
 TEST_CASE("Exceptions") {
@@ -308,6 +1546,67 @@ TEST_CASE("Exceptions") {
         remove(output.c_str());
     }
 
+    SUBCASE("Count larger than the archive holds") {
+        // a canonical header of one 1-bit code claiming 2^40 bytes, followed by 6 bytes of codes
+        std::vector<char> archive;
+        Huffman::BitWriter writer(archive);
+        long long format = Huffman::Tree::canonical_format, count = 1LL << 40;
+        unsigned short symbols = 1;
+        unsigned char symbol = 'a', length = 1, codes = 0;
+        writer << format << count << symbols << symbol << length;
+        for (int i = 0; i < 6; i++)
+            writer << codes;
+        writer.flush();
+        REQUIRE_EQ(archive.size(), 26);
+        Huffman::Tree t;
+        std::vector<char> decoded;
+        CHECK_THROWS_WITH_AS(t.decodeBuffer(archive.data(), archive.size(), decoded), "Header data not found",
+                             std::invalid_argument);
+        CHECK_THROWS_WITH_AS(t.decodedSize(archive.data(), archive.size()), "Header data not found",
+                             std::invalid_argument);
+
+        // nor does a mapped output file take that size, and a failed decoding leaves no output behind
+        std::string input = resource_path("huge-count.bin");
+        std::string output = resource_path("huge-count.out");
+        std::ofstream(input, std::ios::binary).write(archive.data(), archive.size());
+        t.memory_map = true;
+        CHECK_THROWS_WITH_AS(t.decodeFile(input, output), "Header data not found", std::invalid_argument);
+        CHECK_FALSE(std::ifstream(output).good());
+        remove(input.c_str());
+    }
+
+    SUBCASE("Short legacy archive with a mapped output") {
+        std::string input = resource_path("not-enough-bits.bin");
+        std::string output = resource_path("not-enough-bits.out");
+        Huffman::Tree t;
+        t.memory_map = true;
+        CHECK_THROWS_WITH_AS(t.decodeFile(input, output), "Unable to read expected bits", std::invalid_argument);
+        CHECK_FALSE(std::ifstream(output).good());
+        remove(output.c_str());
+    }
+
+    SUBCASE("Oversubscribed code lengths") {
+        std::string input = resource_path("invalid-lengths.bin");
+        std::string output = resource_path("invalid-lengths.out");
+        Huffman::Tree t;
+        CHECK_THROWS_WITH_AS(t.decodeFile(input, output), "Invalid code lengths", std::invalid_argument);
+        remove(output.c_str());
+    }
+
+    SUBCASE("Code lengths over the limit") {
+        std::vector<char> archive;
+        long long tag = Huffman::Tree::canonical_format, count = 1;
+        unsigned short symbols = 1;
+        for (auto field: {std::string((char*) &tag, sizeof(tag)), std::string((char*) &count, sizeof(count)),
+                          std::string((char*) &symbols, sizeof(symbols)), std::string("a"),
+                          std::string(1, (char) (Huffman::Tree::max_code_length_limit + 1)), std::string(8, 0)})
+            archive.insert(archive.end(), field.begin(), field.end());
+        Huffman::Tree t;
+        std::vector<char> decoded;
+        CHECK_THROWS_WITH_AS(t.decodeBuffer(archive.data(), archive.size(), decoded), "Invalid code lengths",
+                             std::invalid_argument);
+    }
+
     SUBCASE("Invalid encoded bits") {
         std::string input = resource_path("invalid-bits.bin");
         std::string output = resource_path("invalid-bits.out");
@@ -324,6 +1623,43 @@ TEST_CASE("Exceptions") {
         remove(output.c_str());
     }
 
+    SUBCASE("Unsupported maximum code length") {
+        std::string input = resource_path("small.txt");
+        std::string output = resource_path("small.out");
+        Huffman::Tree t;
+        t.max_code_length = Huffman::Tree::min_code_length_limit - 1;
+        CHECK_THROWS_WITH_AS(t.encodeFile(input, output), "Invalid maximum code length", std::invalid_argument);
+        remove(output.c_str());
+    }
+
+    SUBCASE("Unsupported block size") {
+        std::string input = resource_path("small.txt");
+        std::string output = resource_path("small.out");
+        Huffman::Tree t;
+        t.block_size = 1;
+        CHECK_THROWS_WITH_AS(t.encodeFile(input, output), "Invalid block size", std::invalid_argument);
+        remove(output.c_str());
+    }
+
+    SUBCASE("Unsupported stream count") {
+        std::string input = resource_path("small.txt");
+        std::string output = resource_path("small.out");
+        Huffman::Tree t;
+        t.streams = 3;
+        CHECK_THROWS_WITH_AS(t.encodeFile(input, output), "Invalid stream count", std::invalid_argument);
+        remove(output.c_str());
+    }
+
+    SUBCASE("Conflicting coding modes") {
+        std::string input = resource_path("small.txt");
+        std::string output = resource_path("small.out");
+        Huffman::Tree t;
+        t.adaptive = true;
+        t.context = true;
+        CHECK_THROWS_WITH_AS(t.encodeFile(input, output), "Conflicting coding modes", std::invalid_argument);
+        remove(output.c_str());
+    }
+
     SUBCASE("file does not exist") {
         std::string input = resource_path("does-not-exist");
         std::string output = resource_path("does-not-exist.out");
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Sample data shared by the tests and the benchmarks
+
+// size bytes of a linear congruential generator, the same text for the same seed
+inline std::string random_text(size_t size, unsigned int seed) {
+    std::string text(size, 0);
+    for (char& c: text)
+        c = (char) ((seed = seed * 1103515245 + 12345) >> 16);
+    return text;
+}
+
+// Frequencies 1, 2, 3, 5, ... of the given number of symbols, which give the deepest code for their total
+inline std::vector<long long> fibonacci_frequencies(int symbols) {
+    std::vector<long long> frequencies(symbols);
+    long long a = 1, b = 1;
+    for (auto& f: frequencies) {
+        f = a;
+        b += a;
+        std::swap(a, b);
+    }
+    return frequencies;
+}
+
+// Symbol c, from 'a' on, repeated as often as its Fibonacci frequency
+inline std::string fibonacci_text(int symbols) {
+    std::string text;
+    std::vector<long long> frequencies = fibonacci_frequencies(symbols);
+    for (int c = 0; c < symbols; c++)
+        text += std::string(frequencies[c], (char) ('a' + c));
+    return text;
+}